@@ -18,6 +18,11 @@ namespace cxxmatrix {
       data1.resize(width * height);
       data2.resize(width * height);
       std::generate(data1.begin(), data1.end(), [] () { return util::rand() & 1; });
+      this->bits_time = 0;
+    }
+    void set_board_size(int width, int height) {
+      this->width = width;
+      this->height = height;
     }
 
   private:
@@ -72,6 +77,54 @@ namespace cxxmatrix {
       create4x4();
     }
 
+  private:
+    // 盤面の各行を 64 点ずつ詰めたもの (点字表示用)
+    int words_per_row = 0;
+    std::vector<std::uint64_t> bits;
+    std::uint32_t bits_time = 0; // bits を詰めた時の time
+  public:
+    // get_braille の前に呼ぶ。盤面が変わっていれば詰め直す (点字表示の時だけ必要)。
+    void pack_bits() {
+      if (bits_time == time) return;
+      bits_time = time;
+      words_per_row = (width + 63) / 64;
+      bits.assign(words_per_row * height, 0);
+      for (int y = 0; y < height; y++) {
+        byte const* const line = &data1[y * width];
+        std::uint64_t* const words = &bits[y * words_per_row];
+        for (int x = 0; x < width; x++)
+          words[x / 64] |= (std::uint64_t) line[x] << (x % 64);
+      }
+    }
+
+  private:
+    // 横2点の組 (下位ビットが左) → 点字の点のビット。行毎に
+    //   1 4      0x01 0x08
+    //   2 5  ->  0x02 0x10
+    //   3 6      0x04 0x20
+    //   7 8      0x40 0x80
+    static constexpr byte braille_dots[4][4] = {
+      {0x00, 0x01, 0x08, 0x09},
+      {0x00, 0x02, 0x10, 0x12},
+      {0x00, 0x04, 0x20, 0x24},
+      {0x00, 0x40, 0x80, 0xC0},
+    };
+  public:
+    // 盤面の点 [2x, 2x + 2) x [4y, 4y + 4) を点字 U+2800 + 返り値の点として返す (pack_bits の後)
+    byte get_braille(int x, int y) const {
+      int const bx = 2 * x;
+      if (bx < 0 || bx >= width) return 0;
+      std::uint64_t const* word = &bits[bx / 64];
+      int const shift = bx % 64;
+      byte dots = 0;
+      for (int r = 0; r < 4; r++) {
+        int const by = 4 * y + r;
+        if (by < 0 || by >= height) continue;
+        dots |= braille_dots[r][word[by * words_per_row] >> shift & 3];
+      }
+      return dots;
+    }
+
   private:
     int origin_x, origin_y;
   public:
@@ -83,13 +136,18 @@ namespace cxxmatrix {
   private:
     static constexpr double xscale = 0.5 * 0.7;
     static constexpr double yscale = -1.0;
+    double xunit = 1.0, yunit = 1.0; // 1つの点の幅・高さ (セル単位)
     double u_x, u_y, v_x, v_y;
   public:
+    void set_unit(double xunit, double yunit) {
+      this->xunit = xunit;
+      this->yunit = yunit;
+    }
     void set_transform(double scale, double theta) {
-      this->u_x = +scale * xscale * std::cos(theta);
-      this->u_y = -scale * yscale * std::sin(theta);
-      this->v_x = +scale * xscale * std::sin(theta);
-      this->v_y = +scale * yscale * std::cos(theta);
+      this->u_x = +scale * xscale * xunit * std::cos(theta);
+      this->u_y = -scale * yscale * yunit * std::sin(theta);
+      this->v_x = +scale * xscale * xunit * std::sin(theta);
+      this->v_y = +scale * yscale * yunit * std::cos(theta);
     }
 
     int get_pixel(int x, int y, double power) const {
@@ -14,20 +14,31 @@
 #include <unordered_map>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <functional>
+#include <memory>
 #include <unistd.h>
 
 #include "cxxmatrix.hpp"
 #include "mandel.hpp"
 #include "conway.hpp"
+#include "pixel.hpp"
+#include "vtmodel.hpp"
 
 namespace cxxmatrix {
   // term_*.cpp
   void term_init();
   bool term_get_size(int& cols, int&rows);
+  bool term_get_cell_size(int& width, int& height);
   void term_enter();
   void term_leave();
   std::ptrdiff_t term_read(byte* buffer, std::size_t size);
+  bool term_write(const char* data, std::size_t size);
+  void term_mask_signals(bool mask);
+  std::ptrdiff_t term_output_queue();
+  std::chrono::nanoseconds term_clock();
+  void term_sleep_until(std::chrono::nanoseconds time);
 
   bool term_winsize_from_env(int& cols, int& rows) {
     int int_cols = -1, int_rows = -1;
@@ -46,7 +57,35 @@ namespace cxxmatrix {
 
 namespace cxxmatrix::config {
   constexpr std::chrono::milliseconds default_frame_interval {40};
+  constexpr std::chrono::microseconds frame_spin_time {300}; // 予定時刻の直前に眠らずに待つ時間
+  constexpr std::chrono::milliseconds frame_spin_max_interval {20}; // 眠らずに待つのはフレームの間隔がこれ以下の時
+  constexpr int max_frame_lag = 4; // 予定時刻からこのフレーム数以上遅れたら遅れを取り戻さずに飛ばす
+  constexpr std::chrono::microseconds writer_grace_time {500}; // 書き込み中の時に書き終わるのを待つ猶予 (シミュレーションを止めない程度に短く)
+  constexpr std::chrono::milliseconds writer_leave_timeout {200}; // 終了・中断の時に書き込みを待つ上限 (端末が止まっていれば諦める)
+  constexpr std::size_t writer_chunk_size = 16384; // 書き込みを中止できる単位
   constexpr int default_decay = 100; // 既定の寿命
+  constexpr double full_repaint_ratio = 0.8; // 実際に変化したセルがこの割合以上の時は全ての行を書き直す
+  constexpr std::size_t max_ordered_units = 4096; // 描画順序を比較する最大の単位数
+  constexpr std::size_t max_nearest_units = 256; // 最近傍の順序を試す最大の単位数
+  constexpr int max_scroll_shift = 3; // 検出するスクロールの最大の行数・列数
+  constexpr int resync_frames = 8; // C-l で全ての行を書き直すのに掛けるフレーム数
+  constexpr int min_scroll_gain = 16; // スクロールで書き直さずに済むセル数の下限
+  constexpr double scroll_detect_ratio = 0.3; // 層がずれていなくても変化したセルがこの割合以上の時はスクロールを探す
+  constexpr int default_cell_width = 10; // 端末がセルの画素数を報告しない時の値
+  constexpr int default_cell_height = 20;
+  constexpr int pixel_levels = 32; // 画像の色数 (背景を含む)
+  constexpr int pixel_tile_cols = 16; // 画像を送り直す単位のセル数
+  constexpr int pixel_tile_rows = 4;
+  constexpr int max_mandel_points = 1 << 17; // 画像に描く時にマンデルブロ集合を計算する最大の点数
+  constexpr int soft_font_width = 8;   // DECDLD で登録する文字の幅 (画素)
+  constexpr int soft_font_height = 10; // DECDLD で登録する文字の高さ (画素)
+  constexpr std::chrono::milliseconds probe_timeout {300}; // 起動時の問い合わせの応答を待つ時間
+  constexpr std::chrono::milliseconds probe_throughput_timeout {1000}; // 転送速度の測定で応答を待つ時間
+  constexpr std::size_t probe_throughput_bytes = 8192; // 転送速度の測定に送るバイト数
+  constexpr double typical_bytes_per_cell = 4.0; // 1フレームで送る1セル当たりのバイト数の目安
+  constexpr double level_hysteresis_frames = 4.0; // --level-hysteresis で閾値以下のずれを保持するフレーム数の目安
+  constexpr int self_test_cols = 80, self_test_rows = 25; // --self-test の画面の大きさ
+  constexpr int self_test_frames = 150; // --self-test で各場面を確かめるフレーム数
 }
 
 namespace cxxmatrix {
@@ -88,33 +127,435 @@ enum colorspace_t {
 };
 
 
+// フレームの予定時刻を絶対時刻で進めて、描画や寝過ごしの時間が積み重ならない様にする。
+// 予定より遅れた時は待たずに次のフレームを始めて遅れを取り戻すが、
+// config::max_frame_lag フレーム以上遅れた時は遅れた分を飛ばして現在時刻から予定を組み直す。
 struct frame_scheduler {
-  using clock_type = std::chrono::high_resolution_clock;
-  clock_type::time_point prev;
-  std::chrono::milliseconds frame_interval;
+  using duration = std::chrono::nanoseconds;
+  duration frame_interval;
+  duration deadline; // 次のフレームの予定時刻 (term_clock)
+  duration prev;     // 前のフレームの開始時刻 (予定を組み直した直後は負)
+
+  // --stats で表示するフレームの開始の予定時刻からの遅れ (jitter) の分布とフレームの間隔
+  static constexpr int jitter_bucket_count = 8;
+  static constexpr double jitter_bounds[jitter_bucket_count - 1] = {50e-6, 100e-6, 250e-6, 500e-6, 1e-3, 2.5e-3, 5e-3};
+  std::uint64_t jitter_histogram[jitter_bucket_count] = {};
+  double max_jitter = 0.0;
+  std::uint64_t period_count = 0;
+  double period_sum = 0.0;
+  double period_sum2 = 0.0;
+  double min_period = 0.0;
+  double max_period = 0.0;
+  std::uint64_t skipped = 0; // 遅れ過ぎて飛ばしたフレーム数
+
   frame_scheduler() {
     frame_interval = config::default_frame_interval;
-    prev = clock_type::now();
+    reset();
+  }
+
+  // 予定を現在時刻から組み直す (起動時の問い合わせや中断から戻った時)
+  void reset() {
+    deadline = term_clock() + frame_interval;
+    prev = duration(-1);
   }
+
   void next_frame() {
-    clock_type::time_point until = prev + frame_interval;
-    clock_type::time_point now = clock_type::now();
-    if (until > now)
-      std::this_thread::sleep_for(until - now);
+    duration now = term_clock();
+    if (now < deadline) {
+      // 間隔が短い時は眠りから覚める遅れを避ける為に予定時刻の直前は眠らずに待つ
+      duration const spin = frame_interval <= config::frame_spin_max_interval ? duration(config::frame_spin_time) : duration(0);
+      if (deadline - now > spin) term_sleep_until(deadline - spin);
+      while ((now = term_clock()) < deadline);
+    }
+    record(now);
+
+    if (now - deadline >= frame_interval * config::max_frame_lag) {
+      skipped += (now - deadline) / frame_interval;
+      deadline = now;
+    }
+    deadline += frame_interval;
+  }
+
+private:
+  void record(duration now) {
+    double const jitter = std::chrono::duration<double>(now - deadline).count();
+    int bucket = 0;
+    while (bucket < jitter_bucket_count - 1 && jitter >= jitter_bounds[bucket]) bucket++;
+    jitter_histogram[bucket]++;
+    max_jitter = std::max(max_jitter, jitter);
+
+    if (prev >= duration(0)) {
+      double const period = std::chrono::duration<double>(now - prev).count();
+      min_period = period_count ? std::min(min_period, period) : period;
+      max_period = std::max(max_period, period);
+      period_sum += period;
+      period_sum2 += period * period;
+      period_count++;
+    }
     prev = now;
   }
+
+public:
+  void print(std::FILE* file) const {
+    double const target = std::chrono::duration<double>(frame_interval).count();
+    double const mean = period_count ? period_sum / period_count : 0.0;
+    double const sd = period_count ? std::sqrt(std::max(period_sum2 / period_count - mean * mean, 0.0)) : 0.0;
+    std::fprintf(file, "cxxmatrix: stats: frame period avg %.3f ms (sd %.3f ms, min %.3f ms, max %.3f ms), target %.3f ms, %llu skipped\n",
+      mean * 1000.0, sd * 1000.0, min_period * 1000.0, max_period * 1000.0, target * 1000.0,
+      (unsigned long long) skipped);
+
+    static const char* const labels[jitter_bucket_count] = {"<50us", "<100us", "<250us", "<500us", "<1ms", "<2.5ms", "<5ms", ">=5ms"};
+    std::fprintf(file, "cxxmatrix: stats: frame jitter");
+    for (int i = 0; i < jitter_bucket_count; i++)
+      std::fprintf(file, "%s %s %llu", i ? "," : "", labels[i], (unsigned long long) jitter_histogram[i]);
+    std::fprintf(file, " (max %.3f ms)\n", max_jitter * 1000.0);
+  }
+};
+
+// 端末が追いつかない時は端末に送るフレームを間引く。
+// シミュレーションは frame_scheduler の間隔で進めて、送る間隔だけを広げる。
+struct output_pacer {
+  static constexpr double max_scale = 16.0;
+  double scale = 1.0; // 端末に送るフレームの間隔 (フレーム数)
+  double credit = 0.0;
+
+  // このフレームを端末に送るかどうか
+  bool next() {
+    credit += 1.0;
+    if (credit < scale) return false;
+    credit = std::min(credit - scale, 1.0);
+    return true;
+  }
+  // 遅れている時は間隔を素早く広げ、出力キューが空になったら少しずつ戻す
+  void update(bool behind, bool drained) {
+    if (behind)
+      scale = std::min(scale * 2.0, max_scale);
+    else if (drained)
+      scale = std::max(scale * 0.8, 1.0);
+  }
+};
+
+// buffer::draw_content_ordered で試す描画順序
+enum draw_order_t {
+  draw_order_column,  // 列毎に上から (雨筋の様な縦の変化)
+  draw_order_color,   // 同じ色の単位を纏めて列毎に
+  draw_order_nearest, // 移動と色設定の費用が最小の単位を順に選ぶ
+  draw_order_row,     // 行毎に左から
+  draw_order_count,
+};
+
+// --stats で終了時に表示する出力の統計
+// 起動時に端末に問い合わせて分かった機能と転送速度 (buffer::term_probe)
+struct term_profile_t {
+  bool responded = false; // 端末が DA1 に応答した
+  int da1_level = 0;      // DA1 の最初の引数 (62 以上ならば VT220 以降)
+  std::string da2;        // DA2 の引数
+  std::string version;    // XTVERSION の応答
+  bool ech = true;        // ECH (CSI Pn X) が使える (CPR で使えないと分かった時だけ偽)
+  bool rep = false;       // REP (CSI Pn b) が使える (CPR で確認)
+  bool drcs = false;      // DECDLD で文字を登録できる (DA1 の引数 7)
+  int sgr_colors = 0;     // DECRQSS で確認した SGR の色数 (0: 不明, 16, 256)
+  double round_trip = 0.0; // 問い合わせの応答までの時間 [秒]
+  double throughput = 0.0; // 端末の処理を含めた転送速度 [バイト/秒] (0: 不明)
+
+  void print(std::FILE* file) const {
+    if (!responded) {
+      std::fprintf(file, "cxxmatrix: stats: terminal did not respond to DA1\n");
+      return;
+    }
+    std::fprintf(file, "cxxmatrix: stats: terminal DA1 level %d, DA2 %s, version %s\n",
+      da1_level, da2.empty() ? "-" : da2.c_str(), version.empty() ? "-" : version.c_str());
+    std::fprintf(file, "cxxmatrix: stats: terminal ECH %s, REP %s, DRCS %s, SGR colors %d, round trip %.2f ms, throughput %.0f KB/s\n",
+      ech ? "yes" : "no", rep ? "yes" : "no", drcs ? "yes" : "no", sgr_colors, round_trip * 1000.0, throughput / 1024.0);
+  }
+};
+
+struct output_stats_t {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::uint64_t frames = 0;  // シミュレーションのフレーム数
+  std::uint64_t sent = 0;    // 端末に送ったフレーム数
+  std::uint64_t paced = 0;   // output_pacer が間引いたフレーム数
+  std::uint64_t dropped = 0; // 書き込み中だったので送らなかったフレーム数
+  std::uint64_t bytes = 0;
+  std::ptrdiff_t last_queue = -1; // 端末の出力キューのバイト数 (不明な時は -1)
+  std::ptrdiff_t max_queue = -1;
+  double total_latency = 0.0;
+  double max_latency = 0.0;
+  std::uint64_t latency_count = 0;
+
+  // draw_content の経路 (全ての行を書き直した・差分を送った) と変化し得るセルの割合
+  std::uint64_t full_frames = 0;
+  std::uint64_t diff_frames = 0;
+  double full_dirty_ratio = 0.0;
+  double diff_dirty_ratio = 0.0;
+  std::uint64_t full_bytes = 0;
+  std::uint64_t diff_bytes = 0;
+  std::uint64_t order_frames[draw_order_count] = {}; // 選ばれた描画順序
+  std::uint64_t vscroll_frames = 0; // 端末の内容を縦・横にずらしたフレーム数
+  std::uint64_t hscroll_frames = 0;
+  std::uint64_t resync_rows = 0; // old_content に関係なく書き直した行数 (--resync-rows, C-l)
+  std::uint64_t pixel_frames = 0; // 画像を送ったフレーム数・タイル数・バイト数
+  std::uint64_t pixel_tiles = 0;
+  std::uint64_t pixel_bytes = 0;
+  std::uint64_t level_target[2] = {}; // --level-hysteresis の目標と表示した色番号の合計 (前景・背景)
+  std::uint64_t level_shown[2] = {};
+
+  void print(std::FILE* file, double scale, double frame_interval) const {
+    double const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::fprintf(file, "cxxmatrix: stats: %.1f s, %llu frames (%.1f fps), %llu sent (%.1f fps), %llu paced, %llu dropped\n",
+      elapsed,
+      (unsigned long long) frames, elapsed > 0.0 ? frames / elapsed : 0.0,
+      (unsigned long long) sent, elapsed > 0.0 ? sent / elapsed : 0.0,
+      (unsigned long long) paced, (unsigned long long) dropped);
+    std::fprintf(file, "cxxmatrix: stats: output %llu bytes (%.0f B/frame), current rate %.1f fps (interval x%.2f)\n",
+      (unsigned long long) bytes, sent ? (double) bytes / sent : 0.0,
+      1.0 / (frame_interval * scale), scale);
+    if (max_queue >= 0)
+      std::fprintf(file, "cxxmatrix: stats: tty queue %td bytes (max %td)\n", last_queue, max_queue);
+    else
+      std::fprintf(file, "cxxmatrix: stats: tty queue unavailable\n");
+    std::fprintf(file, "cxxmatrix: stats: write latency avg %.2f ms, max %.2f ms\n",
+      latency_count ? total_latency / latency_count * 1000.0 : 0.0, max_latency * 1000.0);
+    std::fprintf(file, "cxxmatrix: stats: full repaint %llu frames (dirty %.1f%%, %.0f B/frame), diff %llu frames (dirty %.1f%%, %.0f B/frame), threshold %.0f%%\n",
+      (unsigned long long) full_frames,
+      full_frames ? full_dirty_ratio / full_frames * 100.0 : 0.0,
+      full_frames ? (double) full_bytes / full_frames : 0.0,
+      (unsigned long long) diff_frames,
+      diff_frames ? diff_dirty_ratio / diff_frames * 100.0 : 0.0,
+      diff_frames ? (double) diff_bytes / diff_frames : 0.0,
+      config::full_repaint_ratio * 100.0);
+    std::fprintf(file, "cxxmatrix: stats: update order row %llu, column %llu, color %llu, nearest %llu\n",
+      (unsigned long long) order_frames[draw_order_row],
+      (unsigned long long) order_frames[draw_order_column],
+      (unsigned long long) order_frames[draw_order_color],
+      (unsigned long long) order_frames[draw_order_nearest]);
+    std::fprintf(file, "cxxmatrix: stats: scroll vertical %llu, horizontal %llu\n",
+      (unsigned long long) vscroll_frames, (unsigned long long) hscroll_frames);
+    std::fprintf(file, "cxxmatrix: stats: resync %llu rows\n", (unsigned long long) resync_rows);
+    if (pixel_frames)
+      std::fprintf(file, "cxxmatrix: stats: pixel images %llu frames, %llu tiles (%.0f B/frame)\n",
+        (unsigned long long) pixel_frames, (unsigned long long) pixel_tiles,
+        (double) pixel_bytes / pixel_frames);
+    auto const level_bias = [] (std::uint64_t shown, std::uint64_t target) {
+      return target ? ((double) shown / target - 1.0) * 100.0 : 0.0;
+    };
+    if (level_target[0] || level_target[1])
+      std::fprintf(file, "cxxmatrix: stats: level hysteresis bias fg %+.2f%%, bg %+.2f%%\n",
+        level_bias(level_shown[0], level_target[0]), level_bias(level_shown[1], level_target[1]));
+  }
 };
 
+// 1フレーム分の出力を溜めて一回の write で端末に送る。
+struct output_buffer {
+  static constexpr std::size_t min_capacity = 0x10000;
+
+private:
+  std::vector<char> data;
+  std::size_t used = 0;
+  std::size_t prev_size = 0; // 前フレームの大きさ
+
+public:
+  output_buffer() {
+    data.resize(min_capacity);
+  }
+
+  std::size_t size() const { return used; }
+  char const* begin() const { return data.data(); }
+
+  // n バイト書き込める領域を返す。
+  char* reserve(std::size_t n) {
+    if (used + n > data.size())
+      data.resize(std::max(2 * data.size(), used + n));
+    return data.data() + used;
+  }
+  void commit(std::size_t n) { used += n; }
+  void truncate(std::size_t n) { used = std::min(used, n); }
+
+  void put(char c) {
+    *reserve(1) = c;
+    used++;
+  }
+  void write(const char* s, std::size_t n) {
+    std::memcpy(reserve(n), s, n);
+    used += n;
+  }
+  void write(std::string_view s) {
+    write(s.data(), s.size());
+  }
+  template<std::size_t N>
+  void write(const char (&s)[N]) {
+    write(s, N - 1);
+  }
+
+  void put_dec(unsigned value) {
+    char buff[16];
+    char* p = std::end(buff);
+    do *--p = '0' + value % 10; while (value /= 10);
+    write(p, std::end(buff) - p);
+  }
+  // CSI n F
+  void put_csi(unsigned param, char final) {
+    write("\x1b[");
+    put_dec(param);
+    put(final);
+  }
+  // CSI n F (回数を表す引数の 1 は省略する)
+  void put_csi_count(unsigned count, char final) {
+    write("\x1b[");
+    if (count != 1) put_dec(count);
+    put(final);
+  }
+
+  // 溜まった内容を端末に送る
+  void flush() {
+    if (used == 0) return;
+    term_write(data.data(), used);
+    reset();
+  }
+  // 溜まった内容を storage と交換して取り出す。取り出したバイト数を返す。
+  std::size_t take(std::vector<char>& storage) {
+    std::size_t const size = used;
+    data.swap(storage);
+    reset();
+    return size;
+  }
+private:
+  void reset() {
+    prev_size = used;
+    used = 0;
+
+    // 次のフレームの為に前フレームの大きさを見て予め領域を確保しておく
+    if (data.size() < std::max(min_capacity, 2 * prev_size))
+      data.resize(std::max(min_capacity, 2 * prev_size));
+  }
+};
+
+// 端末への書き込みを別スレッドで行う。
+// 端末が詰まっても描画・キー入力の処理が止まらない様にする為。
+// 書き込み中に次のフレームを渡すことはせず、buffer::draw_content でそのフレームの
+// 出力を見送る (変化は次のフレームに持ち越されて実際に送った内容と比較し直される)。
+struct output_writer {
+private:
+  using clock_type = std::chrono::steady_clock;
+
+  // 書き込みスレッドと共有する状態。端末が止まっている時はスレッドを置き去りにするので
+  // (abandon)、スレッドは output_writer ではなくこの状態を参照する。
+  struct shared_t {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<char> data;
+    std::size_t size = 0;
+    bool pending = false; // data に書き込み待ちの内容がある
+    bool quit = false;
+    bool cancel = false;  // 書き込み中の内容の残りを捨てる
+
+    clock_type::time_point submit_time;
+    clock_type::duration last_latency {0}; // 前回 submit してから書き込みが終わるまでの時間
+  };
+  std::shared_ptr<shared_t> shared = std::make_shared<shared_t>();
+  std::thread thread;
+
+  static void run(std::shared_ptr<shared_t> const& s) {
+    std::unique_lock<std::mutex> lock(s->mutex);
+    for (;;) {
+      s->cond.wait(lock, [&s] { return s->pending || s->quit; });
+      if (!s->pending) break;
+      for (std::size_t pos = 0; pos < s->size && !s->cancel; ) {
+        std::size_t const n = std::min(s->size - pos, config::writer_chunk_size);
+        lock.unlock();
+        term_write(s->data.data() + pos, n);
+        lock.lock();
+        pos += n;
+      }
+      s->last_latency = clock_type::now() - s->submit_time;
+      s->pending = false;
+      s->cond.notify_all();
+    }
+  }
+
+public:
+  ~output_writer() { stop(); }
+
+  // 書き込みにかかる時間 [秒]。書き込み中ならばその経過時間と前回の時間の長い方。
+  double latency() {
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    clock_type::duration value = shared->last_latency;
+    if (shared->pending) value = std::max(value, clock_type::now() - shared->submit_time);
+    return std::chrono::duration<double>(value).count();
+  }
+  // 書き込み待ちの内容がなくなるまで最大 timeout 待つ。書き込みが終わっていれば true。
+  template<typename Duration>
+  bool wait_for(Duration const& timeout) {
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    return shared->cond.wait_for(lock, timeout, [this] { return !shared->pending; });
+  }
+  // out に溜まった内容を書き込む。前の書き込みが終わるまで待つ。
+  void submit(output_buffer& out) {
+    if (out.size() == 0) return;
+    if (!thread.joinable()) {
+      // シグナルは主スレッドで処理する
+      term_mask_signals(true);
+      thread = std::thread([s = shared] { run(s); });
+      term_mask_signals(false);
+    }
+
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->cond.wait(lock, [this] { return !shared->pending; });
+    shared->size = out.take(shared->data);
+    shared->submit_time = clock_type::now();
+    shared->pending = true;
+    shared->cond.notify_all();
+  }
+  // 書き込みを終えてスレッドを終了する
+  void stop() {
+    if (!thread.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(shared->mutex);
+      shared->quit = true;
+    }
+    shared->cond.notify_all();
+    thread.join();
+    shared->quit = false;
+  }
+  // 書き込みが timeout までに終わらなければ、残りを捨ててスレッドを置き去りにする。
+  // 置き去りにしたスレッドは書き込み中の write から戻った時に終了する。
+  template<typename Duration>
+  void stop_for(Duration const& timeout) {
+    if (!thread.joinable()) return;
+    if (wait_for(timeout)) {
+      stop();
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(shared->mutex);
+      shared->quit = true;
+      shared->cancel = true;
+    }
+    shared->cond.notify_all();
+    thread.detach();
+    shared = std::make_shared<shared_t>();
+  }
+};
+
+// 端末のセルの内容 (8バイト)。比較は 64bit 整数として一括で行う (buffer::diff_cells)。
 struct tcell_t {
   char32_t c = U' ';
   level_t fg = 0;
   level_t bg = 0;
   bool bold = false;
-  double diffuse = 0;
+  byte flags = 0; // tcell_flags (比較に含まれるので new_content では常に 0)
+};
+static_assert(sizeof(tcell_t) == sizeof(std::uint64_t));
+
+enum tcell_flags {
+  tflag_unknown = 0x1, // old_content で端末の内容が不明なセル (resync_step)
 };
 
 enum cell_flags {
   cflag_disable_bold = 0x1,
+  cflag_half_block   = 0x2, // 上下に分けて表示する (power は上半分、lower_power は下半分の明るさ)
+  cflag_fixed_char   = 0x4, // 文字を変化させない (エラー率による変化を抑制する)
+  cflag_no_diffuse   = 0x8, // 背景色の拡散効果を付けない
 };
 
 struct cell_t {
@@ -123,9 +564,11 @@ struct cell_t {
   double power = 0; // 初期の明るさ
   double decay = config::default_decay; // 寿命
   std::uint32_t flags = 0;
+  double lower_power = 0; // cflag_half_block: 下半分の初期の明るさ
 
   double stage = 0; // 現在の消滅段階 (0..1.0)
   double current_power = 0; // 現在の明るさ(瞬き処理の前) (0..1.0)
+  double current_lower_power = 0;
 };
 
 struct thread_t {
@@ -135,11 +578,87 @@ struct thread_t {
   int decay;
 };
 
+// 行毎のビットマップ (1ビットが1セル)。
+// 変化し得るセルや空白以外を含み得るセルを記録して、走査する範囲を限定する。
+struct row_mask_t {
+  int cols = 0, words = 0;
+  std::vector<std::uint64_t> bits;
+
+  void resize(int cols, int rows) {
+    this->cols = cols;
+    this->words = (cols + 63) / 64;
+    bits.assign(rows * words, 0);
+  }
+  void clear() { std::fill(bits.begin(), bits.end(), 0); }
+  void fill() {
+    int const rows = words ? bits.size() / words : 0;
+    for (int y = 0; y < rows; y++) set(0, cols, y);
+  }
+
+  std::uint64_t* row(int y) { return &bits[y * words]; }
+  std::uint64_t const* row(int y) const { return &bits[y * words]; }
+  void clear_row(int y) { std::fill_n(row(y), words, 0); }
+  std::size_t count() const {
+    std::size_t count = 0;
+    for (std::uint64_t const word : bits) count += util::popcount(word);
+    return count;
+  }
+  void merge_row(row_mask_t const& other, int y) {
+    std::uint64_t const* const src = other.row(y);
+    std::uint64_t* const dst = row(y);
+    for (int w = 0; w < words; w++) dst[w] |= src[w];
+  }
+
+  void set(int x, int y) {
+    row(y)[x / 64] |= std::uint64_t(1) << x % 64;
+  }
+  void reset(int x, int y) {
+    row(y)[x / 64] &= ~(std::uint64_t(1) << x % 64);
+  }
+  void reset(int x1, int x2, int y) {
+    for (int x = x1; x < x2; x++) reset(x, y);
+  }
+  // [x1, x2) を設定する
+  void set(int x1, int x2, int y) {
+    std::uint64_t* const p = row(y);
+    for (int w = x1 / 64; w * 64 < x2; w++) {
+      int const a = std::max(x1 - w * 64, 0), b = std::min(x2 - w * 64, 64);
+      std::uint64_t const upper = b == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << b) - 1;
+      p[w] |= upper & ~((std::uint64_t(1) << a) - 1);
+    }
+  }
+
+  // 行 y で設定されたセルの連続を範囲 [x1, x2) として列挙する。
+  // proc の中で既に列挙した位置のビットを変更しても良い。
+  template<typename F>
+  void for_each_span(int y, F&& proc) const {
+    std::uint64_t const* const p = row(y);
+    int x1 = -1;
+    for (int w = 0; w < words; w++) {
+      std::uint64_t const word = p[w];
+      for (int i = 0; i < 64; ) {
+        // 連続の開始 (x1 < 0) または終端を探す
+        std::uint64_t const rest = (x1 < 0 ? word : ~word) >> i;
+        if (!rest) break;
+        i += util::countr_zero(rest);
+        if (x1 < 0) {
+          x1 = w * 64 + i;
+        } else {
+          proc(x1, w * 64 + i);
+          x1 = -1;
+        }
+      }
+    }
+    if (x1 >= 0) proc(x1, cols);
+  }
+};
+
 struct layer_t {
   int cols, rows;
   int scrollx, scrolly;
   std::vector<cell_t> content;
   std::vector<thread_t> threads;
+  row_mask_t lit; // 空白以外であり得るセル (content の座標)
 
 private:
   int error_rate_modulo = 20;
@@ -152,12 +671,14 @@ public:
   void resize(int cols, int rows) {
     content.clear();
     content.resize(cols * rows);
+    lit.resize(cols, rows);
     this->cols = cols;
     this->rows = rows;
     scrollx = 0;
     scrolly = 0;
   }
   cell_t& cell(int x, int y) {
+    lit.set(x, y); // 書き込まれる可能性があるので記録する
     return content[y * cols + x];
   }
   cell_t& rcell(int x, int y) {
@@ -166,10 +687,28 @@ public:
     return cell(x, y);
   }
   cell_t const& cell(int x, int y) const {
-    return const_cast<layer_t*>(this)->cell(x, y);
+    return content[y * cols + x];
   }
   cell_t const& rcell(int x, int y) const {
-    return const_cast<layer_t*>(this)->rcell(x, y);
+    x = util::mod(x + scrollx, cols);
+    y = util::mod(y + scrolly, rows);
+    return cell(x, y);
+  }
+
+  // 画面の行 y で空白以外であり得るセルを画面の座標で mask に記録する
+  void lit_columns(int y, row_mask_t& mask) const {
+    int const ly = util::mod(y + scrolly, rows);
+    lit.for_each_span(ly, [&] (int x1, int x2) {
+      int const width = x2 - x1;
+      x1 = util::mod(x1 - scrollx, cols);
+      x2 = x1 + width;
+      if (x2 <= cols) {
+        mask.set(x1, x2, y);
+      } else {
+        mask.set(x1, cols, y);
+        mask.set(0, x2 - cols, y);
+      }
+    });
   }
 
 public:
@@ -204,21 +743,30 @@ public:
 public:
   void resolve_level(int now) {
     for (int y = 0; y < rows; y++) {
-      for (int x = 0; x < cols; x++) {
-        cell_t& cell = this->rcell(x, y);
-        if (cell.c == ' ') continue;
+      lit.for_each_span(y, [&] (int x1, int x2) {
+        for (int x = x1; x < x2; x++) {
+          cell_t& cell = content[y * cols + x];
+          if (cell.c == ' ') {
+            lit.reset(x, y);
+            continue;
+          }
 
-        int const age = now - cell.birth;
-        cell.stage = 1.0 - age / cell.decay;
-        if (cell.stage < 0.0) {
-          cell.c = ' ';
-          continue;
-        }
+          int const age = now - cell.birth;
+          cell.stage = 1.0 - age / cell.decay;
+          if (cell.stage < 0.0) {
+            cell.c = ' ';
+            lit.reset(x, y);
+            continue;
+          }
 
-        cell.current_power = cell.power * cell.stage;
-        if (error_rate_modulo && util::rand() % error_rate_modulo == 0)
-          cell.c = util::rand_char();
-      }
+          cell.current_power = cell.power * cell.stage;
+          if (cell.flags & cflag_half_block)
+            cell.current_lower_power = cell.lower_power * cell.stage;
+          if (cell.flags & cflag_fixed_char) continue;
+          if (error_rate_modulo && util::rand() % error_rate_modulo == 0)
+            cell.c = util::rand_char();
+        }
+      });
     }
   }
 };
@@ -238,6 +786,7 @@ struct key_reader {
   bool term_nonblock_save = false;
 
   std::function<void(key_t)> proc;
+  std::function<void(byte, std::string const&)> report_proc;
 
 public:
   void leave() {
@@ -256,21 +805,79 @@ private:
     if (proc) proc(k);
   }
 
+  void process_report(byte final, std::string const& params) {
+    if (report_proc) report_proc(final, params);
+  }
+
   bool esc = false;
+  bool csi = false; // ESC [ の後
+  std::string csi_params;
+
+  // 端末への問い合わせ中は ESC P (DCS) を応答の文字列として受け取る。
+  // (それ以外の時に Alt-P の後の入力を飲み込まない様にする)
+public:
+  bool accept_dcs = false;
+private:
+  bool dcs = false;
+  bool dcs_esc = false;
+  std::string dcs_data;
+  void process_dcs_byte(byte b) {
+    if (dcs_esc) {
+      dcs_esc = false;
+      if (b == '\\') {
+        dcs = false;
+        process_report('P', dcs_data);
+        return;
+      }
+      dcs_data += '\x1b';
+    }
+    if (b == 0x1b)
+      dcs_esc = true;
+    else if (dcs_data.size() < 1024)
+      dcs_data += (char) b;
+  }
+
   void process_byte(byte b) {
+    if (dcs) {
+      process_dcs_byte(b);
+      return;
+    }
     if (b == 0x1b) {
       esc = true;
+      csi = false;
+      csi_params.clear();
       return;
     }
     if (esc) {
-      if (0x40 <= b && b < 0x80) {
+      if (0x20 <= b && b < 0x40) {
+        if (csi) {
+          // 端末からの応答 (CSI Ps... F) の引数・中間文字
+          csi_params += (char) b;
+        } else {
+          // Alt+数字などは読み捨てて、次の文字はキーとして扱う
+          esc = false;
+        }
+      } else if (0x40 <= b && b < 0x80) {
+        if (csi_params.size() && !('A' <= b && b <= 'D')) {
+          esc = false;
+          process_report(b, csi_params);
+          return;
+        }
         switch (b) {
         case 'A': esc = false; process_key(key_up   ); break;
         case 'B': esc = false; process_key(key_down ); break;
         case 'C': esc = false; process_key(key_right); break;
         case 'D': esc = false; process_key(key_left ); break;
-        case '[': break;
+        case '[': csi = true; break;
         case 'O': break;
+        case 'P':
+          esc = false;
+          if (accept_dcs) {
+            // DCS の応答 (DECRQSS, XTVERSION)
+            dcs = true;
+            dcs_data.clear();
+          }
+          break;
         default: esc = false; break;
         }
       } else if (0x80 <= b) {
@@ -294,6 +901,13 @@ public:
 };
 
 
+// フラクタル・ライフゲームの場面で1セルに表示する標本の数
+enum subcell_t {
+  subcell_none = 0,
+  subcell_half = 1, // 上下2つ (U+2580/U+2584)
+  subcell_braille = 2, // 2x4 の点字 (U+2800-U+28FF)。ライフゲームのみ (フラクタルは subcell_half)
+};
+
 enum scene_t {
   scene_none         = 0,
   scene_number       = 1,
@@ -313,6 +927,17 @@ private:
   bool setting_diffuse_enabled = true;
   bool setting_twinkle_enabled = true;
   bool setting_preserve_background = false;
+  bool setting_sync_update_detect = true;
+  bool setting_sync_update = false;
+  bool setting_stats_enabled = false;
+  bool setting_scroll_region = true;
+  pixel_protocol_t setting_pixel_protocol = pixel_none;
+  subcell_t setting_subcell = subcell_none;
+  double setting_level_hysteresis = 1.0;
+  bool setting_stable_glyphs = false;
+  bool setting_colorspace_auto = true; // 端末の応答に従って16色に切り替える
+  bool setting_soft_font = false;
+  bool setting_osc_palette = false;
   double setting_rain_interval = 150;
 public:
   void set_diffuse_enabled(bool value) {
@@ -328,6 +953,38 @@ public:
   void set_rain_density(double value) {
     setting_rain_interval = 150 / value;
   }
+  void set_sync_update(bool value) {
+    this->setting_sync_update_detect = false;
+    this->setting_sync_update = value;
+  }
+  void set_stats_enabled(bool value) {
+    this->setting_stats_enabled = value;
+  }
+  void set_scroll_region(bool value) {
+    this->setting_scroll_region = value;
+  }
+  void set_pixel_protocol(pixel_protocol_t value) {
+    this->setting_pixel_protocol = value;
+    canvas.set_protocol(value);
+  }
+  void set_subcell(subcell_t value) {
+    this->setting_subcell = value;
+  }
+  void set_level_hysteresis(double value) {
+    this->setting_level_hysteresis = value;
+  }
+  void set_stable_glyphs(bool value) {
+    this->setting_stable_glyphs = value;
+  }
+  void set_colorspace_auto(bool value) {
+    this->setting_colorspace_auto = value;
+  }
+  void set_soft_font(bool value) {
+    this->setting_soft_font = value;
+  }
+  void set_osc_palette(bool value) {
+    this->setting_osc_palette = value;
+  }
 
 private:
   layer_t layers[3];
@@ -341,14 +998,31 @@ private:
   int cols = 80, rows = 25;
   std::vector<tcell_t> old_content;
   std::vector<tcell_t> new_content;
-  std::FILE* file;
+  std::vector<float> diffuse_plane; // construct_render_content での背景色の計算用
+  row_mask_t content_mask; // new_content が空白 (背景色なし) 以外であり得るセル
+  row_mask_t dirty_mask; // new_content と old_content が異なり得るセル (diff_row 後は異なるセル)
+  output_buffer out;
+  output_writer writer;
+
+  void submit_output() {
+    if (self_test_active) {
+      std::size_t const size = out.take(self_test_data);
+      self_test_model.feed(self_test_data.data(), size);
+      return;
+    }
+    writer.submit(out);
+  }
 
 private:
-  bool flag_sigint = false;
-  bool flag_winch = false;
+  volatile std::sig_atomic_t flag_sigint = false;
+  volatile std::sig_atomic_t flag_winch = false;
+  volatile std::sig_atomic_t flag_tstp = false;
+  volatile std::sig_atomic_t flag_cont = false;
 public:
   void notify_sigint() { flag_sigint = true; }
   void notify_winch() { flag_winch = true; }
+  void notify_tstp() { flag_tstp = true; }
+  void notify_cont() { flag_cont = true; }
   void process_signals() {
     if (flag_sigint) {
       this->finalize();
@@ -356,6 +1030,20 @@ public:
       std::raise(SIGINT);
       std::exit(128 + SIGINT);
     }
+#ifdef SIGTSTP
+    if (flag_tstp) {
+      flag_tstp = false;
+      this->term_leave();
+      std::signal(SIGTSTP, SIG_DFL);
+      std::raise(SIGTSTP);
+    }
+    if (flag_cont) {
+      flag_cont = false;
+      std::signal(SIGTSTP, traptstp);
+      this->term_enter();
+      flag_winch = true;
+    }
+#endif
     if (flag_winch) {
       flag_winch = false;
       initialize();
@@ -365,17 +1053,54 @@ public:
 
 private:
   frame_scheduler scheduler;
+  output_pacer pacer;
+  output_stats_t stats;
+  bool output_attempted = false; // このフレームで端末に送ろうとした
+  bool output_dropped = false;   // 書き込み中だったので送らなかった
+  std::size_t last_frame_size = 0;
   void next_frame() {
     process_signals();
-    scheduler.next_frame();
+    if (!self_test_active) scheduler.next_frame();
+
+    // 描画内容はフレームの境界でまとめて端末に送る
+    stats.frames++;
+    if (out.size()) {
+      last_frame_size = out.size();
+      stats.bytes += out.size();
+    }
+    submit_output();
+    if (self_test_active) self_test_frame();
+
+    if (output_attempted && !self_test_active) update_pacing();
+    output_attempted = output_dropped = false;
+  }
+
+  // 端末の出力キュー (TIOCOUTQ) と書き込みにかかった時間から、端末が追い付いているか判定する。
+  void update_pacing() {
+    std::ptrdiff_t const queue = term_output_queue();
+    double const latency = writer.latency();
+    double const interval = std::chrono::duration<double>(scheduler.frame_interval).count() * pacer.scale;
+
+    stats.last_queue = queue;
+    stats.max_queue = std::max(stats.max_queue, queue);
+    stats.total_latency += latency;
+    stats.max_latency = std::max(stats.max_latency, latency);
+    stats.latency_count++;
+
+    // 1フレーム分以上が端末に送られずに残っていれば遅れている
+    std::ptrdiff_t const queue_limit = std::max<std::ptrdiff_t>(last_frame_size, 4096);
+    bool const behind = output_dropped || latency > interval || queue > queue_limit;
+    // 出力キューが分からない時 (-1) は書き込みにかかった時間だけで判断する
+    bool const drained = queue < 0 ? latency < 0.25 * interval : queue == 0 && latency < 0.5 * interval;
+    pacer.update(behind, drained);
   }
 public:
   void set_frame_rate(double frame_rate) {
-    using msec_rep = std::chrono::milliseconds::rep;
-    constexpr msec_rep max_frame_interval = 1000 * 3600;
+    using nsec_rep = frame_scheduler::duration::rep;
+    constexpr double max_frame_interval = 3600.0;
 
-    double const frame_interval = 1000 / frame_rate;
-    scheduler.frame_interval = std::chrono::milliseconds((msec_rep) std::clamp(frame_interval, 1.0, (double) max_frame_interval));
+    double const frame_interval = 1.0 / frame_rate;
+    scheduler.frame_interval = frame_scheduler::duration((nsec_rep) (std::clamp(frame_interval, 0.001, max_frame_interval) * 1e9));
   }
 
 public:
@@ -383,215 +1108,1296 @@ public:
 
 public:
   buffer() {
+    canvas.set_tile_size(config::pixel_tile_cols, config::pixel_tile_rows);
     initialize_color_table(index2color(47), colorspace_xterm_256);
   }
 
 private:
-  void put_utf8(char32_t uc) {
-    std::uint32_t u = uc;
+  // 出力の部品 (SGR の引数、文字の UTF-8) は予め固定長のトークンに変換しておき、
+  // 出力時には固定長の memcpy で書き込んでから実際の長さだけ進める。
+  struct sgr_token_t {
+    byte size = 0;
+    char data[31];
+  };
+  // 文字を出力する前に GL に呼び出しておく文字集合。空白や UTF-8 の文字はどちらでも良い。
+  enum glyph_shift_t : byte {
+    glyph_shift_g0,  // SI で G0 (ASCII)
+    glyph_shift_g1,  // SO で G1 (DECDLD で登録した文字)
+    glyph_shift_any,
+  };
+  struct glyph_token_t {
+    byte size = 0;
+    char data[4];
+    glyph_shift_t shift = glyph_shift_any;
+  };
+  static constexpr std::size_t max_sgr_size = 2 + 4 * sizeof(sgr_token_t::data);
+  static constexpr std::size_t max_cell_size = max_sgr_size + 1 + sizeof(glyph_token_t::data);
+
+  std::vector<sgr_token_t> sgrfg_tokens;
+  std::vector<sgr_token_t> sgrbg_tokens;
+  sgr_token_t sgrbg_default_token;
+  sgr_token_t sgr_bold_tokens[2];
+
+  // 0x00-0x7F, U+FF00-U+FFFF (半角カナ) と U+2800-U+28FF (点字) の UTF-8 表現
+  static constexpr std::uint32_t glyph_table_halfwidth = 0xFF00;
+  static constexpr std::uint32_t glyph_table_braille = 0x2800;
+  glyph_token_t glyph_tokens[0x80 + 0x100 + 0x100];
+
+  static glyph_token_t encode_utf8(char32_t uc) {
+    std::uint32_t const u = uc;
+    glyph_token_t token;
+    char* const p = token.data;
     if (u < 0x80) {
-      std::putc(u, file);
+      p[0] = u;
+      token.size = 1;
+      if (0x21 <= u && u <= 0x7E) token.shift = glyph_shift_g0;
     } else if (u < 0x800) {
-      std::putc(0xC0 | (u >> 6), file);
-      std::putc(0x80 | (u & 0x3F), file);
+      p[0] = 0xC0 | (u >> 6);
+      p[1] = 0x80 | (u & 0x3F);
+      token.size = 2;
     } else if (u < 0x10000) {
-      std::putc(0xE0 | (u >> 12), file);
-      std::putc(0x80 | (0x3F & u >> 6), file);
-      std::putc(0x80 | (0x3F & u), file);
+      p[0] = 0xE0 | (u >> 12);
+      p[1] = 0x80 | (0x3F & u >> 6);
+      p[2] = 0x80 | (0x3F & u);
+      token.size = 3;
     } else if (u < 0x200000) {
-      std::putc(0xF0 | (u >> 18), file);
-      std::putc(0x80 | (0x3F & u >> 12), file);
-      std::putc(0x80 | (0x3F & u >> 6), file);
-      std::putc(0x80 | (0x3F & u), file);
+      p[0] = 0xF0 | (u >> 18);
+      p[1] = 0x80 | (0x3F & u >> 12);
+      p[2] = 0x80 | (0x3F & u >> 6);
+      p[3] = 0x80 | (0x3F & u);
+      token.size = 4;
+    }
+    return token;
+  }
+  static sgr_token_t make_sgr_token(std::string const& seq) {
+    // "CSI Ps... m" から引数部分 "Ps..." を取り出す
+    sgr_token_t token;
+    std::size_t const size = std::min(seq.size() - 3, sizeof token.data);
+    std::memcpy(token.data, seq.data() + 2, size);
+    token.size = size;
+    return token;
+  }
+  void initialize_tokens() {
+    sgrfg_tokens.clear();
+    sgrbg_tokens.clear();
+    for (std::string const& seq: setfg_table)
+      sgrfg_tokens.push_back(make_sgr_token(seq));
+    for (std::string const& seq: setbg_table)
+      sgrbg_tokens.push_back(make_sgr_token(seq));
+    sgrbg_default_token = make_sgr_token("\x1b[49m");
+    sgr_bold_tokens[0] = make_sgr_token("\x1b[22m");
+    sgr_bold_tokens[1] = make_sgr_token("\x1b[1m");
+
+    for (std::uint32_t u = 0; u < 0x80; u++)
+      glyph_tokens[u] = encode_utf8(u);
+    for (std::uint32_t u = 0; u < 0x100; u++)
+      glyph_tokens[0x80 + u] = encode_utf8(glyph_table_halfwidth + u);
+    for (std::uint32_t u = 0; u < 0x100; u++)
+      glyph_tokens[0x180 + u] = encode_utf8(glyph_table_braille + u);
+
+    if (soft_font_active) {
+      for (soft_glyph_t const& glyph: soft_glyphs) {
+        std::uint32_t const u = glyph.c;
+        glyph_token_t& token = glyph_tokens[u < 0x80 ? u : 0x80 + (u - glyph_table_halfwidth)];
+        token.size = 1;
+        token.data[0] = glyph.code;
+        token.shift = glyph_shift_g1;
+      }
+    }
+  }
+
+  glyph_token_t glyph_token(char32_t uc) const {
+    std::uint32_t const u = uc;
+    if (u < 0x80) return glyph_tokens[u];
+    if (u - glyph_table_halfwidth < 0x100) return glyph_tokens[0x80 + (u - glyph_table_halfwidth)];
+    if (u - glyph_table_braille < 0x100) return glyph_tokens[0x180 + (u - glyph_table_braille)];
+    return encode_utf8(uc);
+  }
+  static char* write_token(char* p, sgr_token_t const& token) {
+    std::memcpy(p, token.data, sizeof token.data);
+    return p + token.size;
+  }
+
+  // DECDLD で登録する文字 (rand_char の文字の内 glyph.def に形があるもの)。
+  // 登録すると半角カナも G1 の1バイトで送れる。
+  struct soft_glyph_t {
+    char32_t c;
+    byte code; // G1 での文字コード
+    std::vector<std::uint16_t> rows; // 各行の画素のビット列 (最下位ビットが左端)
+  };
+  std::vector<soft_glyph_t> soft_glyphs;
+  bool soft_font_active = false;
+
+  void initialize_soft_glyphs() {
+    if (soft_glyphs.size()) return;
+    for (int index = 0; index < util::rand_char_count; index++) {
+      char32_t const c = util::rand_char_at(index);
+      glyph_definition_t const* const def = banner_message_t::glyph_data(c);
+      if (!def || def->c != c) continue;
+
+      // 幅 soft_font_width x 高さ soft_font_height のセルの上から1行目に中央揃えで置く
+      soft_glyph_t glyph;
+      glyph.c = c;
+      glyph.code = 0x21 + soft_glyphs.size();
+      glyph.rows.assign((config::soft_font_height + 5) / 6 * 6, 0);
+      int const offset = std::max((config::soft_font_width - 1 - def->w) / 2, 0);
+      for (int y = 0; y < glyph_definition_t::height; y++)
+        glyph.rows[1 + y] = def->lines[y] << offset;
+      soft_glyphs.push_back(glyph);
+    }
+  }
+  // DECDLD で soft_glyphs を登録して G1 に指定する
+  void soft_font_download() {
+    initialize_soft_glyphs();
+    out.write("\x1bP1;1;0;");
+    out.put_dec(config::soft_font_width);
+    out.write(";0;2;");
+    out.put_dec(config::soft_font_height);
+    out.write(";0{ @");
+    for (soft_glyph_t const& glyph: soft_glyphs) {
+      if (glyph.code != 0x21) out.put(';');
+      for (std::size_t band = 0; band < glyph.rows.size(); band += 6) {
+        if (band) out.put('/');
+        for (int x = 0; x < config::soft_font_width; x++) {
+          int sixel = 0;
+          for (int k = 0; k < 6; k++)
+            if (glyph.rows[band + k] >> x & 1) sixel |= 1 << k;
+          out.put(0x3F + sixel);
+        }
+      }
     }
+    out.write("\x1b\\");
+    out.write("\x1b) @\x0f"); // SCS (G1 = Dscs " @"), SI
   }
 
-  level_t fg;
-  level_t bg;
-  bool bold;
+  struct sgr_state_t {
+    level_t fg;
+    level_t bg;
+    bool bold;
+    glyph_shift_t shift; // GL の文字集合 (glyph_shift_g0 または glyph_shift_g1)
+  };
+  sgr_state_t sgr;
   void sgr0() {
-    std::fprintf(file, "\x1b[H\x1b[m");
+    out.write("\x1b[H\x1b[m");
+    if (soft_font_active) out.put('\x0f'); // SI
     px = py = 0;
-    fg = -1;
-    bg = -1;
-    bold = false;
+    sgr.fg = -1;
+    sgr.bg = -1;
+    sgr.bold = false;
+    sgr.shift = glyph_shift_g0;
   }
-  void set_color(tcell_t const& tcell) {
-    if (tcell.bg != this->bg) {
-      this->bg = tcell.bg;
-      if (setting_preserve_background && this->bg == level_background)
-        std::fprintf(file, "\x1b[49m");
-      else {
-        auto const& seq = setbg_table[this->bg];
-        std::fwrite(seq.data(), seq.size(), 1, file);
+
+  sgr_token_t const& sgrbg_token(level_t bg) const {
+    if (setting_preserve_background && bg == level_background)
+      return sgrbg_default_token;
+    return sgrbg_tokens[bg];
+  }
+
+  // 前景色・背景色・太字の変更を一つの SGR にまとめて書き込む。
+  // p からは max_sgr_size バイト書き込める必要がある。
+  char* encode_sgr(char* p, sgr_state_t& state, tcell_t const& tcell) const {
+    bool const bg_changed = tcell.bg != state.bg;
+    bool const fg_changed = tcell.c != ' ' && tcell.fg != state.fg;
+    bool const bold_changed = tcell.c != ' ' && tcell.bold != state.bold;
+    if (!(bg_changed || fg_changed || bold_changed)) return p;
+
+    *p++ = '\x1b';
+    *p++ = '[';
+    if (fg_changed) {
+      state.fg = tcell.fg;
+      p = write_token(p, sgrfg_tokens[state.fg]);
+      *p++ = ';';
+    }
+    if (bg_changed) {
+      state.bg = tcell.bg;
+      p = write_token(p, sgrbg_token(state.bg));
+      *p++ = ';';
+    }
+    if (bold_changed) {
+      state.bold = tcell.bold;
+      p = write_token(p, sgr_bold_tokens[state.bold]);
+      *p++ = ';';
+    }
+    p[-1] = 'm';
+    return p;
+  }
+  // 上半分のブロック (fg = 上, bg = 下) は前景色と背景色を入れ替えた下半分のブロックと同じ
+  // 見た目になる。上下が同じ色ならば空白 (背景色) や全体のブロック (前景色) とも同じ。
+  // new_content・old_content では上半分のブロックに統一しておき、書き込む時に現在の
+  // SGR からの変更が最も少ない形を選ぶ。
+  static constexpr char32_t half_block_upper = U'\u2580';
+  static constexpr char32_t half_block_lower = U'\u2584';
+  static constexpr char32_t full_block = U'\u2588';
+  tcell_t half_block_form(sgr_state_t const& state, tcell_t const& tcell) const {
+    tcell_t best = tcell;
+    sgr_state_t tmp = state;
+    std::size_t best_cost = set_color_cost_plain(tmp, best);
+    auto const consider = [&] (char32_t c, level_t fg, level_t bg) {
+      tcell_t form = tcell;
+      form.c = c;
+      form.fg = fg;
+      form.bg = bg;
+      sgr_state_t tmp = state;
+      if (std::size_t const cost = set_color_cost_plain(tmp, form); cost < best_cost) {
+        best = form;
+        best_cost = cost;
       }
+    };
+    consider(half_block_lower, tcell.bg, tcell.fg);
+    if (tcell.fg == tcell.bg) {
+      consider(' ', state.fg, tcell.bg);
+      consider(full_block, tcell.fg, state.bg);
+    }
+    return best;
+  }
+
+  // p からは max_cell_size バイト書き込める必要がある。
+  char* encode_cell(char* p, sgr_state_t& state, tcell_t tcell) const {
+    if (tcell.c == half_block_upper) tcell = half_block_form(state, tcell);
+    p = encode_sgr(p, state, tcell);
+    glyph_token_t const glyph = glyph_token(tcell.c);
+    if (glyph.shift != state.shift && glyph.shift != glyph_shift_any) {
+      *p++ = glyph.shift == glyph_shift_g1 ? '\x0e' : '\x0f'; // SO/SI
+      state.shift = glyph.shift;
+    }
+    std::memcpy(p, glyph.data, sizeof glyph.data);
+    return p + glyph.size;
+  }
+
+  void set_color(tcell_t const& tcell) {
+    char* const p = out.reserve(max_sgr_size);
+    out.commit(encode_sgr(p, sgr, tcell) - p);
+  }
+  // set_color が出力するバイト数 (state は更新される)
+  std::size_t set_color_cost(sgr_state_t& state, tcell_t const& tcell) const {
+    if (tcell.c == half_block_upper)
+      return set_color_cost_plain(state, half_block_form(state, tcell));
+    return set_color_cost_plain(state, tcell);
+  }
+  std::size_t set_color_cost_plain(sgr_state_t& state, tcell_t const& tcell) const {
+    std::size_t cost = 0;
+    if (tcell.bg != state.bg) {
+      state.bg = tcell.bg;
+      cost += sgrbg_token(state.bg).size + 1;
     }
     if (tcell.c != ' ') {
-      if (tcell.fg != fg) {
-        this->fg = tcell.fg;
-        auto const& seq = setfg_table[this->fg];
-        std::fwrite(seq.data(), seq.size(), 1, file);
+      if (tcell.fg != state.fg) {
+        state.fg = tcell.fg;
+        cost += sgrfg_tokens[state.fg].size + 1;
+      }
+      if (tcell.bold != state.bold) {
+        state.bold = tcell.bold;
+        cost += sgr_bold_tokens[state.bold].size + 1;
       }
-      if (tcell.bold != bold) {
-        this->bold = tcell.bold;
-        std::fprintf(file, "\x1b[%dm", this->bold ? 1 : 22);
+    }
+    return cost ? cost + 2 : 0;
+  }
+
+  // 連続するセル [x, x + count) をまとめて書き込む。
+  // 端末が REP に対応していれば同じセルの繰り返しは REP (CSI Pn b) で送る。
+  void put_cells(int x, int count, tcell_t const* cells) {
+    char* const begin = out.reserve(count * max_cell_size);
+    char* p = begin;
+    for (int i = 0; i < count; ) {
+      tcell_t const& tcell = cells[i++];
+      p = encode_cell(p, sgr, tcell);
+      if (!term_profile.rep) continue;
+
+      int repeat = 0;
+      while (i + repeat < count && std::memcmp(&cells[i + repeat], &tcell, sizeof tcell) == 0) repeat++;
+      if (repeat && (std::size_t) csi_count_cost(repeat) < (std::size_t) repeat * glyph_token(tcell.c).size) {
+        *p++ = '\x1b';
+        *p++ = '[';
+        if (repeat != 1) p += std::sprintf(p, "%d", repeat);
+        *p++ = 'b';
+        i += repeat;
       }
     }
+    out.commit(p - begin);
+    px = x + count < cols ? x + count : -1;
   }
 
 private:
+  // カーソル位置 (-1 は不明)。DECAWM を無効にしているので最終列に書き込んだ後は
+  // 端末によってカーソル位置の扱いが異なる。その場合は px = -1 とする。
   int px = -1, py = -1;
-  void goto_xy(int x, int y) {
+
+  static int dec_width(unsigned value) {
+    int width = 1;
+    while (value >= 10) value /= 10, width++;
+    return width;
+  }
+  // CSI Pn F (Pn = 1 は省略) の長さ
+  static int csi_count_cost(unsigned count) {
+    return count == 1 ? 3 : 3 + dec_width(count);
+  }
+
+  enum cursor_move_t {
+    move_none,
+    move_cup,     // CUP (CSI Py;Px H)
+
+    vmove_lf,     // LF の繰り返し (OPOST は無効なので列は変わらない)
+    vmove_cud,    // CUD (CSI Pn B)
+    vmove_cuu,    // CUU (CSI Pn A)
+    vmove_vpa,    // VPA (CSI Py d)
+
+    hmove_cr,     // CR
+    hmove_bs,     // BS の繰り返し
+    hmove_cub,    // CUB (CSI Pn D)
+    hmove_cuf,    // CUF (CSI Pn C)。HPR (CSI Pn a) は同じ長さなので CUF で代表する。
+    hmove_cha,    // CHA (CSI Px G)
+    hmove_reemit, // 間のセルを old_content の内容で書き直す
+  };
+
+  static constexpr int reemit_max_distance = 8;
+
+  int cup_cost(int x, int y) const {
+    // CSI H, CSI Py H, CSI ;Px H, CSI Py;Px H
+    int cost = 3;
+    if (y > 0) cost += dec_width(y + 1);
+    if (x > 0) cost += 1 + dec_width(x + 1);
+    return cost;
+  }
+
+  int vmove_cost(int y, cursor_move_t& method) const {
     if (y == py) {
-      if (x != px) {
-        if (x == 0) {
-          std::putc('\r', file);
-        } else if (px - 3 <= x && x < px) {
-          while (x < px--)
-            std::putc('\b', file);
-        } else {
-          std::fprintf(file, "\x1b[%dG", x + 1);
-        }
-        px = x;
+      method = move_none;
+      return 0;
+    }
+
+    int cost;
+    if (y < py) {
+      method = vmove_cuu;
+      cost = csi_count_cost(py - y);
+    } else {
+      method = vmove_cud;
+      cost = csi_count_cost(y - py);
+      if (y - py <= cost) {
+        method = vmove_lf;
+        cost = y - py;
       }
-      return;
     }
+    if (int const vpa = 3 + dec_width(y + 1); vpa < cost) {
+      method = vmove_vpa;
+      cost = vpa;
+    }
+    return cost;
+  }
 
-    // \v が思うように動いていない?
-    // if (x <= px && py < y && (x == 0 ? 1 : px - x) + (y - py) <= (x == 0 || x == px ? 3 : 5)) {
-    //   if (x != px) {
-    //     if (x == 0) {
-    //       std::putc('\r', file);
-    //       px = 0;
-    //     } else {
-    //       while (x < px--)
-    //         std::putc('\b', file);
-    //     }
-    //   }
-    //   while (py++ < y)
-    //     std::putc('\v', file);
-    //   return;
-    // }
+  // 間のセルを書き直した場合の費用。target の色設定の変化分も含める。
+  int reemit_cost(int x, int y, tcell_t const* target) const {
+    sgr_state_t state = sgr;
+    int cost = 0;
+    for (int x1 = px; x1 < x; x1++) {
+      tcell_t const& ocell = old_content[y * cols + x1];
+      if (ocell.flags & tflag_unknown) return std::numeric_limits<int>::max(); // 内容が不明なセル (resync_step)
+      cost += set_color_cost(state, ocell) + glyph_token(ocell.c).size;
+    }
+    if (target) {
+      sgr_state_t state0 = sgr;
+      cost += (int) set_color_cost(state, *target) - (int) set_color_cost(state0, *target);
+    }
+    return cost;
+  }
 
+  int hmove_cost(int x, int y, tcell_t const* target, cursor_move_t& method) const {
+    if (x == px && px >= 0) {
+      method = move_none;
+      return 0;
+    }
+
+    method = hmove_cha;
+    int cost = x == 0 ? 3 : 3 + dec_width(x + 1);
     if (x == 0) {
-      std::fprintf(file, "\x1b[%dH", y + 1);
-      px = x;
-      py = y;
-      return;
-    } else if (x == px) {
-      if (y < py) {
-        std::fprintf(file, "\x1b[%dA", py - y);
-      } else {
-        std::fprintf(file, "\x1b[%dB", y - py);
+      method = hmove_cr;
+      cost = 1;
+    }
+    if (px < 0) return cost;
+
+    if (x < px) {
+      if (px - x < cost) {
+        method = hmove_bs;
+        cost = px - x;
+      }
+      if (int const cub = csi_count_cost(px - x); cub < cost) {
+        method = hmove_cub;
+        cost = cub;
       }
+    } else {
+      if (int const cuf = csi_count_cost(x - px); cuf < cost) {
+        method = hmove_cuf;
+        cost = cuf;
+      }
+      if (y == py && x - px <= reemit_max_distance && x - px < cost) {
+        if (int const reemit = reemit_cost(x, y, target); reemit < cost) {
+          method = hmove_reemit;
+          cost = reemit;
+        }
+      }
+    }
+    return cost;
+  }
+
+  // 現在のカーソル位置から (x, y) に移動する費用と方法
+  int goto_cost(int x, int y, tcell_t const* target, cursor_move_t& vmethod, cursor_move_t& hmethod) const {
+    vmethod = hmethod = move_cup;
+    int cost = cup_cost(x, y);
+    if (py >= 0) {
+      cursor_move_t vm, hm;
+      int const vcost = vmove_cost(y, vm);
+      if (vcost < cost) {
+        int const hcost = hmove_cost(x, y, target, hm);
+        if (vcost + hcost < cost) {
+          vmethod = vm;
+          hmethod = hm;
+          cost = vcost + hcost;
+        }
+      }
+    }
+    return cost;
+  }
+
+  void goto_xy(int x, int y, tcell_t const* target = nullptr) {
+    cursor_move_t vmethod, hmethod;
+    goto_cost(x, y, target, vmethod, hmethod);
+
+    if (vmethod == move_cup) {
+      out.write("\x1b[");
+      if (y > 0) out.put_dec(y + 1);
+      if (x > 0) {
+        out.put(';');
+        out.put_dec(x + 1);
+      }
+      out.put('H');
+      px = x;
       py = y;
       return;
     }
 
-    std::fprintf(file, "\x1b[%d;%dH", y + 1, x + 1);
-    px = x;
+    switch (vmethod) {
+    case vmove_lf:
+      for (int i = py; i < y; i++) out.put('\n');
+      break;
+    case vmove_cud: out.put_csi_count(y - py, 'B'); break;
+    case vmove_cuu: out.put_csi_count(py - y, 'A'); break;
+    case vmove_vpa: out.put_csi(y + 1, 'd'); break;
+    default: break;
+    }
     py = y;
+
+    switch (hmethod) {
+    case hmove_cr: out.put('\r'); break;
+    case hmove_bs:
+      for (int i = x; i < px; i++) out.put('\b');
+      break;
+    case hmove_cub: out.put_csi_count(px - x, 'D'); break;
+    case hmove_cuf: out.put_csi_count(x - px, 'C'); break;
+    case hmove_cha:
+      if (x == 0)
+        out.write("\x1b[G");
+      else
+        out.put_csi(x + 1, 'G');
+      break;
+    case hmove_reemit:
+      put_cells(px, x - px, &old_content[y * cols + px]);
+      break;
+    default: break;
+    }
+    px = x;
   }
 
 private:
-  static bool is_changed(tcell_t const& ncell, tcell_t const& ocell) {
-    if (ncell.c != ocell.c || ncell.bg != ocell.bg) return true;
-    if (ncell.c == ' ') return false;
-    if (ncell.fg != ocell.fg || ncell.bold != ocell.bold) return true;
-    return false;
-  }
-  bool term_draw_cell(int x, int y, std::size_t index, bool force_write) {
-    tcell_t& ncell = new_content[index];
-    tcell_t& ocell = old_content[index];
-    if (ncell.fg == ocell.bg) ncell.c = ' ';
-    if (force_write || is_changed(ncell, ocell)) {
-      goto_xy(x, y);
-      set_color(ncell);
-      put_utf8(ncell.c);
-      px++;
-      ocell = ncell;
-      return true;
+  // tcell_t を 64bit 整数として見た時の各フィールドの位置
+  struct tcell_bits_t {
+    std::uint64_t c; // c のビット
+    std::uint64_t blank; // c = ' ' の値
+    std::uint64_t flags; // flags のビット
+    std::uint64_t blank_key; // 空白で意味を持つビット (前景色・太字は表示に影響しない)
+    int fg_shift, bg_shift;
+  };
+  static tcell_bits_t const tcell_bits;
+
+  // 雨の文字 (rand_char の文字と ASCII)。前景色が背景色と同じ時は空白と区別が付かない。
+  // 半角ブロックや点字は前景色・背景色の両方で形を表すので含めない。
+  static bool is_rain_glyph(char32_t c) {
+    return c < 0x80 || (char32_t) (c - U'\uFF61') <= U'\uFF9F' - U'\uFF61';
+  }
+
+  // 連続するセル (count <= 64) を比較して、変化したセルのビットマップを返す。
+  // 変化した雨の文字の前景色が背景色と同じ (見えない) 時は空白に置き換える。
+  // 空白の前景色・太字は 0 に揃えるので、変化のないブロックは memcmp で読み飛ばせる。
+  // それ以外は分岐のない整数演算で比較する。
+  static std::uint64_t diff_cells(tcell_t* ncells, tcell_t const* ocells, int count) {
+    if (std::memcmp(ncells, ocells, count * sizeof(tcell_t)) == 0) return 0;
+
+    tcell_bits_t const bits = tcell_bits;
+    std::uint64_t mask = 0;
+    for (int i = 0; i < count; i++) {
+      std::uint64_t n, o;
+      std::memcpy(&n, &ncells[i], sizeof n);
+      std::memcpy(&o, &ocells[i], sizeof o);
+      std::uint64_t const hide = -std::uint64_t(n != o && is_rain_glyph(ncells[i].c) &&
+        (n >> bits.fg_shift & 0xFF) == (n >> bits.bg_shift & 0xFF));
+      n = (n & ~(hide & bits.c)) | (hide & bits.blank);
+      n &= (n & bits.c) == bits.blank ? bits.blank_key : ~std::uint64_t(0);
+      std::memcpy(static_cast<void*>(&ncells[i]), &n, sizeof n);
+
+      std::uint64_t const okey = o & ((o & bits.c) == bits.blank ? bits.blank_key : ~std::uint64_t(0));
+      mask |= std::uint64_t(n != okey) << i;
+    }
+    return mask;
+  }
+
+  // dirty_mask の1語分 (64セル) を実際に変化したセルに絞り込む。
+  // 比較するのは最初と最後の印の間だけ。
+  std::uint64_t diff_word(int w, int y) {
+    std::uint64_t const dirty = dirty_mask.row(y)[w];
+    int const lo = util::countr_zero(dirty), hi = 63 - util::countl_zero(dirty);
+    std::size_t const index = y * cols + w * 64 + lo;
+    return diff_cells(&new_content[index], &old_content[index], hi + 1 - lo) << lo;
+  }
+  void diff_row(int y) {
+    std::uint64_t* const dirty = dirty_mask.row(y);
+    for (int w = 0; w < dirty_mask.words; w++)
+      if (dirty[w]) dirty[w] = diff_word(w, y);
+  }
+  bool is_dirty(int x, int y) const {
+    return dirty_mask.row(y)[x / 64] >> x % 64 & 1;
+  }
+  void put_cell(int x, int y, tcell_t const& tcell) {
+    goto_xy(x, y, &tcell);
+    put_cells(x, 1, &tcell);
+  }
+
+  // (x, y) から始まる変化したセルの連続をまとめて書き込む。書き込んだセル数を返す。
+  // 途中で空白になるセルがあればそこで止める (term_erase_cells で消去を試みる為)。
+  int term_draw_span(int x, int y) {
+    std::size_t const index = y * cols + x;
+    int x2 = x + 1;
+    while (x2 < cols && is_dirty(x2, y) && new_content[y * cols + x2].c != ' ') x2++;
+
+    int const count = x2 - x;
+    goto_xy(x, y, &new_content[index]);
+    put_cells(x, count, &new_content[index]);
+    std::copy_n(&new_content[index], count, &old_content[index]);
+    return count;
+  }
+
+  // 空白になるセルの連続を ECH (CSI Pn X) または EL (CSI K) で消去する。
+  // 消去は set_color で選択した背景色で行われる。消去したセル数を返す。
+  int term_erase_cells(int x, int y) {
+    tcell_t const& head = new_content[y * cols + x];
+
+    // 同じ背景色の空白の範囲 [x, x2) と、その中で最後に変化するセル
+    int x2 = x + 1, xlast = x;
+    int literal_cost = 1;
+    for (; x2 < cols; x2++) {
+      tcell_t const& ncell = new_content[y * cols + x2];
+      if (ncell.c != ' ' || ncell.bg != head.bg) break;
+      if (is_dirty(x2, y)) {
+        literal_cost += 1 + std::min(x2 - xlast - 1, 3);
+        xlast = x2;
+      }
     }
-    return false;
+
+    // VT100 級の端末には ECH がないので行末までの EL だけを使う
+    bool const eol = x2 == cols;
+    if (!eol && !term_profile.ech) return 0;
+
+    int count = xlast + 1 - x;
+    int erase_cost = 2 * csi_count_cost(count);
+    if (eol && (3 < erase_cost || !term_profile.ech)) {
+      count = x2 - x;
+      erase_cost = 3;
+    }
+    if (erase_cost >= literal_cost) return 0;
+
+    goto_xy(x, y, &head);
+    set_color(head);
+    if (eol && erase_cost == 3)
+      out.write("\x1b[K");
+    else
+      out.put_csi_count(count, 'X');
+    for (int x1 = x; x1 < x + count; x1++)
+      old_content[y * cols + x1] = new_content[y * cols + x1];
+    return count;
   }
 
 public:
   void redraw() {
+    std::size_t const mark = sync_update_begin();
+    px = py = -1;
+    old_content.resize(new_content.size());
+    if (pixel_active) canvas.clear(out);
+    draw_content_full();
     goto_xy(0, 0);
+    sync_update_end(mark);
+    stats.bytes += out.size();
+    submit_output();
+  }
+
+  // Synchronized update (DEC private mode 2026) で囲む
+  std::size_t sync_update_begin() {
+    std::size_t const mark = out.size();
+    if (setting_sync_update) out.write("\x1b[?2026h");
+    return mark;
+  }
+  void sync_update_end(std::size_t mark) {
+    if (!setting_sync_update) return;
+    if (out.size() == mark + 8)
+      out.truncate(mark); // 変化がなかったので何も送らない
+    else
+      out.write("\x1b[?2026l");
+  }
+
+private:
+  // 帯域制限: 1フレームで送るバイト数の上限 (0 は無制限)
+  std::size_t setting_max_bytes_per_frame = 0;
+  double setting_link_bps = 0.0;
+public:
+  void set_max_bytes_per_frame(std::size_t value) {
+    this->setting_max_bytes_per_frame = value;
+  }
+  void set_link_bps(double value) {
+    this->setting_link_bps = value;
+  }
+private:
+  std::size_t frame_byte_budget() const {
+    std::size_t budget = setting_max_bytes_per_frame;
+    if (setting_link_bps > 0.0) {
+      double const seconds = std::chrono::duration<double>(scheduler.frame_interval).count() * pacer.scale;
+      std::size_t const link_budget = std::max(1.0, setting_link_bps / 8 * seconds);
+      if (budget == 0 || link_budget < budget) budget = link_budget;
+    }
+    return budget;
+  }
+
+  struct dirty_cell_t {
+    std::uint32_t index;
+    std::uint32_t priority;
+  };
+  std::vector<dirty_cell_t> dirty_cells;
+  std::vector<std::uint16_t> deferred_frames; // 描画が見送られたフレーム数
+
+  // 使い切らなかった予算は次のフレームに持ち越す (最大で予算2フレーム分)。
+  // 超過分は次のフレーム以降の予算から差し引く。
+  std::ptrdiff_t budget_balance = 0;
+
+  int cell_brightness(tcell_t const& tcell) const {
+    return tcell.c == ' ' ? tcell.bg : std::max(tcell.fg, tcell.bg);
+  }
+
+  // 変化したセルを重要度順に並べて、予算に収まる分だけ描画する。
+  // 残りのセルは old_content が更新されないので次のフレームに持ち越される。
+  void draw_content_prioritized(std::size_t budget, std::size_t mark) {
+    budget_balance = std::min<std::ptrdiff_t>(budget_balance + budget, 2 * budget);
+    budget = std::max<std::ptrdiff_t>(budget_balance, 0);
+    deferred_frames.resize(new_content.size());
+    dirty_cells.clear();
     for (int y = 0; y < rows; y++) {
-      for (int x = 0; x < cols; x++) {
-        // 行末 xenl 対策
-        if (y == rows - 1) {
-          if (x == cols - 2) {
-            tcell_t const& cell = new_content[y * cols + x + 1];
-            set_color(cell);
-            put_utf8(cell.c);
-            std::fprintf(file, "\b\x1b[@");
-          } else if (x == cols -1) {
-            continue;
-          }
+      std::uint64_t* const dirty = dirty_mask.row(y);
+      for (int w = 0; w < dirty_mask.words; w++) {
+        if (!dirty[w]) continue;
+        std::uint64_t const changed = diff_word(w, y);
+
+        // 変化しなくなったセルの待ち時間を戻す
+        std::size_t const index = y * cols + w * 64;
+        for (std::uint64_t settled = dirty[w] & ~changed; settled; settled &= settled - 1)
+          deferred_frames[index + util::countr_zero(settled)] = 0;
+        dirty[w] = changed;
+      }
+
+      dirty_mask.for_each_span(y, [&] (int x1, int x2) {
+        for (int x = x1; x < x2; x++) {
+          std::size_t const index = y * cols + x;
+          tcell_t const& ncell = new_content[index];
+          tcell_t const& ocell = old_content[index];
+
+          // 明るさの変化量 + 雨筋の先頭 + 待たされたフレーム数
+          std::uint32_t priority = std::abs(cell_brightness(ncell) - cell_brightness(ocell));
+          if (ncell.c != ' ' && (y + 1 == rows || new_content[index + cols].c == ' '))
+            priority += level_count;
+          priority += 4 * deferred_frames[index];
+          dirty_cells.push_back({(std::uint32_t) index, priority});
         }
+      });
+      dirty_mask.clear_row(y);
+    }
 
-        tcell_t const& tcell = new_content[y * cols + x];
-        set_color(tcell);
-        put_utf8(tcell.c);
-      }
+    std::stable_sort(dirty_cells.begin(), dirty_cells.end(),
+      [] (auto const& a, auto const& b) { return a.priority > b.priority; });
+
+    // 予算に収まる分を選ぶ (カーソル移動は平均 6 バイトと見積もる)。
+    // 予算が残っている限り少なくとも1セルは描画する。
+    std::size_t estimate = 0, nselect = 0;
+    for (; nselect < dirty_cells.size(); nselect++) {
+      tcell_t const& ncell = new_content[dirty_cells[nselect].index];
+      std::size_t const cost = glyph_token(ncell.c).size + setfg_table[ncell.fg].size() + setbg_table[ncell.bg].size() + 6;
+      if (estimate + cost > budget && (nselect || budget == 0)) break;
+      estimate += cost;
     }
-    std::fprintf(file, "\x1b[H");
-    std::fflush(file);
 
-    old_content.resize(new_content.size());
-    for (std::size_t i = 0; i < new_content.size(); i++)
-      old_content[i] = new_content[i];
+    std::sort(dirty_cells.begin(), dirty_cells.begin() + nselect,
+      [] (auto const& a, auto const& b) { return a.index < b.index; });
+    for (std::size_t i = 0; i < dirty_cells.size(); i++) {
+      std::uint32_t const index = dirty_cells[i].index;
+      if (i < nselect && (i == 0 || out.size() - mark < budget)) {
+        put_cell(index % cols, index / cols, new_content[index]);
+        old_content[index] = new_content[index];
+        deferred_frames[index] = 0;
+      } else {
+        if (deferred_frames[index] < std::numeric_limits<std::uint16_t>::max())
+          deferred_frames[index]++;
+        dirty_mask.set(index % cols, index / cols);
+      }
+    }
+    budget_balance -= out.size() - mark;
   }
 
-  void draw_content() {
+  // 殆どのセルが変化する時は差分を取らずに全ての行を順に書き直す
+  void draw_content_full() {
     for (int y = 0; y < rows; y++) {
-      for (int x = 0; x < cols - 1; x++) {
-        std::size_t const index = y * cols + x;
+      tcell_t const* const row = &new_content[y * cols];
+      goto_xy(0, y, row);
+      put_cells(0, cols, row);
+    }
+    std::copy(new_content.begin(), new_content.end(), old_content.begin());
+    dirty_mask.clear();
+  }
+
+  // 変化したセルの横の連続。描画順序を決める単位。
+  struct draw_unit_t {
+    int x1, x2, y;
+  };
+  std::vector<draw_unit_t> draw_units; // 行毎に左から
+  std::vector<draw_unit_t> draw_orders[draw_order_count];
+  std::vector<draw_unit_t> draw_pool;
+  std::vector<tcell_t> draw_saved_cells;
+  std::vector<std::uint64_t> draw_saved_mask;
+
+  // 単位の中で未だ描画していないセルを描画する。消去は単位を超えて
+  // 行われることがあるので、描画したセルは dirty_mask から外しておく。
+  void draw_unit(draw_unit_t const& unit) {
+    int const y = unit.y;
+    for (int x = unit.x1; x < unit.x2; ) {
+      if (!is_dirty(x, y)) {
+        x++;
+        continue;
+      }
+      int count = 0;
+      if (new_content[y * cols + x].c == ' ')
+        count = term_erase_cells(x, y);
+      if (!count)
+        count = term_draw_span(x, y);
+      dirty_mask.reset(x, x + count, y);
+      x += count;
+    }
+  }
+
+  // 現在のカーソル位置・SGR から始めて、移動と色設定の費用が最も小さい単位を順に選ぶ
+  void draw_order_nearest_neighbor(std::vector<draw_unit_t>& order) {
+    int const px0 = px, py0 = py;
+    sgr_state_t const sgr0 = sgr;
+    draw_pool = draw_units;
+    while (draw_pool.size()) {
+      std::size_t best = 0;
+      int best_cost = std::numeric_limits<int>::max();
+      for (std::size_t i = 0; i < draw_pool.size(); i++) {
+        draw_unit_t const& unit = draw_pool[i];
+        tcell_t const& head = new_content[unit.y * cols + unit.x1];
+        cursor_move_t vmethod, hmethod;
+        sgr_state_t state = sgr;
+        int const cost = goto_cost(unit.x1, unit.y, &head, vmethod, hmethod) + set_color_cost(state, head);
+        if (cost < best_cost) {
+          best = i;
+          best_cost = cost;
+        }
+      }
+
+      draw_unit_t const unit = draw_pool[best];
+      order.push_back(unit);
+      for (int x = unit.x1; x < unit.x2; x++)
+        set_color_cost(sgr, new_content[unit.y * cols + x]);
+      px = unit.x2 < cols ? unit.x2 : -1;
+      py = unit.y;
+      draw_pool[best] = draw_pool.back();
+      draw_pool.pop_back();
+    }
+    px = px0;
+    py = py0;
+    sgr = sgr0;
+  }
+
+  // 変化したセルを幾つかの順序で試しに描画して、出力が最も短い順序を使う。
+  // 雨筋の様に縦に並ぶ変化は列毎に描画すると LF・BS だけで移動できる。
+  void draw_content_ordered() {
+    draw_units.clear();
+    for (int y = 0; y < rows; y++)
+      dirty_mask.for_each_span(y, [&] (int x1, int x2) { draw_units.push_back({x1, x2, y}); });
+
+    if (draw_units.size() <= 1 || draw_units.size() > config::max_ordered_units) {
+      for (draw_unit_t const& unit : draw_units) draw_unit(unit);
+      stats.order_frames[draw_order_row]++;
+      return;
+    }
+
+    auto const color_key = [this] (draw_unit_t const& unit) {
+      tcell_t const& head = new_content[unit.y * cols + unit.x1];
+      return head.c == ' ' ? head.bg : 1 << 24 | head.fg << 16 | head.bg << 8 | head.bold;
+    };
+    for (auto& order : draw_orders) order.clear();
+    draw_orders[draw_order_column] = draw_units;
+    std::stable_sort(draw_orders[draw_order_column].begin(), draw_orders[draw_order_column].end(),
+      [] (auto const& a, auto const& b) { return a.x1 < b.x1; });
+    draw_orders[draw_order_color] = draw_orders[draw_order_column];
+    std::stable_sort(draw_orders[draw_order_color].begin(), draw_orders[draw_order_color].end(),
+      [&] (auto const& a, auto const& b) { return color_key(a) < color_key(b); });
+    if (draw_units.size() <= config::max_nearest_units)
+      draw_order_nearest_neighbor(draw_orders[draw_order_nearest]);
+    draw_orders[draw_order_row] = draw_units;
+
+    // 試し描きで変更される状態を保存する
+    std::size_t const mark = out.size();
+    int const px0 = px, py0 = py;
+    sgr_state_t const sgr0 = sgr;
+    draw_saved_mask = dirty_mask.bits;
+    draw_saved_cells.clear();
+    for (draw_unit_t const& unit : draw_units)
+      draw_saved_cells.insert(draw_saved_cells.end(), &old_content[unit.y * cols + unit.x1], &old_content[unit.y * cols + unit.x2]);
+    auto const restore = [&] {
+      out.truncate(mark);
+      px = px0;
+      py = py0;
+      sgr = sgr0;
+      dirty_mask.bits = draw_saved_mask;
+      tcell_t const* saved = draw_saved_cells.data();
+      for (draw_unit_t const& unit : draw_units) {
+        std::copy_n(saved, unit.x2 - unit.x1, &old_content[unit.y * cols + unit.x1]);
+        saved += unit.x2 - unit.x1;
+      }
+    };
+
+    // 最後に試した行毎の順序が最短ならばその出力をそのまま使う
+    int best = draw_order_row;
+    std::size_t best_size = std::numeric_limits<std::size_t>::max();
+    for (int order = 0; order < draw_order_count; order++) {
+      if (draw_orders[order].empty()) continue;
+      for (draw_unit_t const& unit : draw_orders[order]) draw_unit(unit);
+      std::size_t const size = out.size() - mark;
+      if (size < best_size) {
+        best = order;
+        best_size = size;
+      }
+      if (order != draw_order_row || best != draw_order_row) restore();
+    }
+    if (best != draw_order_row)
+      for (draw_unit_t const& unit : draw_orders[best]) draw_unit(unit);
+    stats.order_frames[best]++;
+  }
+
+  // 端末の内容をずらす操作。行の範囲 [top, bottom) を dx 列・dy 行ずらす。
+  struct scroll_t {
+    int dx = 0, dy = 0;
+    int top = 0, bottom = 0;
+    int gain = 0; // 書き直さずに済むセル数
+  };
+  bool term_decslrm = false; // 端末が DECSLRM に対応している (DECRQM で確認)
+  int scroll_request_dx = 0; // 場面が指定した横のずれ (送らなかったフレームの分も溜める)
+  std::vector<int> scroll_row_same; // 各行でずらさずに一致するセル数
+  std::vector<int> scroll_row_gain;
+
+  // 比較用の値 (空白の前景色・太字は表示に影響しないので無視する)
+  static std::uint64_t cell_key(tcell_t const& cell) {
+    std::uint64_t value;
+    std::memcpy(&value, &cell, sizeof value);
+    return value & ((value & tcell_bits.c) == tcell_bits.blank ? tcell_bits.blank_key : ~std::uint64_t(0));
+  }
+  // スクロールで現れる行・列は現在の背景色で埋められる (BCE)
+  tcell_t scroll_blank() const {
+    tcell_t blank;
+    blank.bg = sgr.bg < level_count ? sgr.bg : 0;
+    return blank;
+  }
 
-        bool dirty = true;
+  // 行 y の内容を old_content 上で (dx, dy) ずらした時に一致するセル数。画面外は空白。
+  int scroll_row_match(int y, int dx, int dy, std::uint64_t blank_key) const {
+    int const sy = y - dy;
+    int match = 0;
+    for (int x = 0; x < cols; x++) {
+      int const sx = x - dx;
+      std::uint64_t const okey = 0 <= sx && sx < cols && 0 <= sy && sy < rows ? cell_key(old_content[sy * cols + sx]) : blank_key;
+      match += cell_key(new_content[y * cols + x]) == okey;
+    }
+    return match;
+  }
 
-        // 行末 xenl 対策
-        if (x == cols - 2 && term_draw_cell(x, y, index + 1, false)) {
-          std::fprintf(file, "\b\x1b[@");
-          px--;
-          dirty = true;
+  // 新しい内容が古い内容を縦または横にずらしたものに近い時、最も得になるずらし方を求める。
+  // 行毎の得失の和が最大になる行の範囲をスクロール領域とする。
+  // DECSLRM がない時の横のずれは行毎に ICH/DCH で移動するので、その費用を行毎に差し引く。
+  // request_dx を指定した時はその横のずれだけを調べる。
+  scroll_t detect_scroll(bool vertical, bool horizontal, int request_dx = 0) {
+    std::uint64_t const blank_key = cell_key(scroll_blank());
+    scroll_row_same.resize(rows);
+    scroll_row_gain.resize(rows);
+    for (int y = 0; y < rows; y++)
+      scroll_row_same[y] = scroll_row_match(y, 0, 0, blank_key);
+
+    scroll_t best;
+    auto const consider = [&] (int dx, int dy) {
+      int const row_cost = dx && !(term_decslrm && setting_scroll_region) ? 1 : 0;
+      for (int y = 0; y < rows; y++)
+        scroll_row_gain[y] = scroll_row_match(y, dx, dy, blank_key) - scroll_row_same[y] - row_cost;
+
+      int sum = 0, top = 0;
+      scroll_t cand;
+      cand.dx = dx;
+      cand.dy = dy;
+      for (int y = 0; y < rows; y++) {
+        if (sum <= 0) {
+          sum = 0;
+          top = y;
         }
+        sum += scroll_row_gain[y];
+        if (sum > cand.gain) {
+          cand.gain = sum;
+          cand.top = top;
+          cand.bottom = y + 1;
+        }
+      }
 
-        term_draw_cell(x, y, index, dirty);
+      // 縦のスクロールでは元の行も領域に含める。その分の行は空白になる。
+      if (dy > 0) {
+        for (int y = std::max(cand.top - dy, 0); y < cand.top; y++)
+          cand.gain += scroll_row_match(y, 0, rows, blank_key) - scroll_row_same[y];
+        cand.top = std::max(cand.top - dy, 0);
+      } else if (dy < 0) {
+        for (int y = cand.bottom; y < std::min(cand.bottom - dy, rows); y++)
+          cand.gain += scroll_row_match(y, 0, rows, blank_key) - scroll_row_same[y];
+        cand.bottom = std::min(cand.bottom - dy, rows);
       }
+      // 空白を出すだけで行を動かさない領域は選ばない (1 行のスクロール領域は DECSTBM で設定できない)
+      if (dy && cand.bottom - cand.top <= std::abs(dy)) return;
+      if (cand.gain > best.gain) best = cand;
+    };
+    if (request_dx) {
+      consider(request_dx, 0);
+      return best;
+    }
+    for (int d = 1; vertical && d <= config::max_scroll_shift && d < rows; d++) {
+      consider(0, d);
+      consider(0, -d);
+    }
+    for (int d = 1; horizontal && d <= config::max_scroll_shift && d < cols; d++) {
+      consider(d, 0);
+      consider(-d, 0);
+    }
+    return best;
+  }
+
+  // 場面が内容を横に dx 列ずらした時に呼ぶ。draw_content はずれの量を探さずに、そのずれで
+  // 得になる行の範囲だけを求めて端末の内容をずらす。--no-scroll-region の時もスクロール
+  // 領域を使わない ICH/DCH でずらす。
+  void request_hscroll(int dx) {
+    scroll_request_dx += dx;
+  }
+
+  // detect_scroll は候補毎に画面全体を走査するので、前に送ったフレームから層がずれた方向
+  // と、変化し得るセルが多い時だけ調べる。層を使わずに内容をずらす場面は request_hscroll で伝える。
+  int scroll_layer_x[3] = {};
+  int scroll_layer_y[3] = {};
+  bool scroll_hint_x = false;
+  bool scroll_hint_y = false;
+  void scroll_hint_update() {
+    for (int i = 0; i < 3; i++) {
+      if (layers[i].scrollx != scroll_layer_x[i]) scroll_hint_x = true;
+      if (layers[i].scrolly != scroll_layer_y[i]) scroll_hint_y = true;
+      scroll_layer_x[i] = layers[i].scrollx;
+      scroll_layer_y[i] = layers[i].scrolly;
     }
-    std::fflush(file);
+  }
+
+  void put_scroll_region(int top, int bottom) {
+    out.write("\x1b[");
+    out.put_dec(top + 1);
+    out.put(';');
+    out.put_dec(bottom);
+    out.put('r');
+  }
+
+  // 端末の内容をずらして、old_content も同様にずらす。ずらした範囲は改めて差分を取る。
+  void term_scroll(scroll_t const& scroll) {
+    if (sgr.bg >= level_count) set_color(tcell_t());
+    tcell_t const blank = scroll_blank();
+    int const top = scroll.top, bottom = scroll.bottom;
+    bool const region = top != 0 || bottom != rows;
+
+    if (scroll.dy) {
+      int const count = std::abs(scroll.dy);
+      if (bottom == rows) {
+        // 画面の下端までならば IL (CSI Pn L)・DL (CSI Pn M) で済む
+        goto_xy(0, top);
+        out.put_csi_count(count, scroll.dy > 0 ? 'L' : 'M');
+      } else {
+        // DECSTBM (CSI Pt;Pb r) の中で SD (CSI Pn T)・SU (CSI Pn S)。DECSTBM はカーソルを原点に移動する。
+        put_scroll_region(top, bottom);
+        out.put_csi_count(count, scroll.dy > 0 ? 'T' : 'S');
+        out.write("\x1b[r");
+        px = py = 0;
+      }
+
+      if (scroll.dy > 0) {
+        for (int y = bottom; --y >= top; ) {
+          tcell_t* const dst = &old_content[y * cols];
+          if (y - count >= top)
+            std::copy_n(&old_content[(y - count) * cols], cols, dst);
+          else
+            std::fill_n(dst, cols, blank);
+        }
+      } else {
+        for (int y = top; y < bottom; y++) {
+          tcell_t* const dst = &old_content[y * cols];
+          if (y + count < bottom)
+            std::copy_n(&old_content[(y + count) * cols], cols, dst);
+          else
+            std::fill_n(dst, cols, blank);
+        }
+      }
+      stats.vscroll_frames++;
+    } else {
+      int const count = std::abs(scroll.dx);
+      if (term_decslrm && setting_scroll_region) {
+        // SR (CSI Pn SP A)・SL (CSI Pn SP @)
+        if (region) put_scroll_region(top, bottom);
+        out.write("\x1b[");
+        if (count != 1) out.put_dec(count);
+        out.write(scroll.dx > 0 ? " A" : " @");
+        if (region) {
+          out.write("\x1b[r");
+          px = py = 0;
+        }
+      } else {
+        // 各行の左端で ICH (CSI Pn @)・DCH (CSI Pn P)
+        for (int y = top; y < bottom; y++) {
+          goto_xy(0, y);
+          out.put_csi_count(count, scroll.dx > 0 ? '@' : 'P');
+        }
+      }
+
+      for (int y = top; y < bottom; y++) {
+        tcell_t* const line = &old_content[y * cols];
+        if (scroll.dx > 0) {
+          std::copy_backward(line, line + cols - count, line + cols);
+          std::fill_n(line, count, blank);
+        } else {
+          std::copy(line + count, line + cols, line);
+          std::fill_n(line + cols - count, count, blank);
+        }
+      }
+      stats.hscroll_frames++;
+    }
+
+    for (int y = top; y < bottom; y++) {
+      dirty_mask.set(0, cols, y);
+      diff_row(y);
+    }
+  }
+
+  // 端末の内容が他のプロセスの出力などで壊れても直る様に、old_content に関係なく
+  // 毎フレーム setting_resync_rows 行ずつ順に書き直す。C-l で要求された時は
+  // 全ての行を config::resync_frames フレームに分けて書き直す。
+  int setting_resync_rows = 0;
+  int resync_row = 0;       // 次に書き直す行
+  int resync_remaining = 0; // C-l で要求された残りの行数
+public:
+  void set_resync_rows(int value) {
+    this->setting_resync_rows = value;
+  }
+  void request_resync() {
+    resync_remaining = rows;
+    if (pixel_active) canvas.invalidate();
+  }
+private:
+  void resync_step() {
+    int count = setting_resync_rows;
+    if (resync_remaining > 0) {
+      count = std::max(count, (rows + config::resync_frames - 1) / config::resync_frames);
+      resync_remaining = std::max(resync_remaining - count, 0);
+    }
+    count = std::min(count, rows);
+    if (count <= 0) return;
+
+    // 端末の SGR やカーソル位置も変わっているかもしれない。
+    // 不明なセルは tflag_unknown を付けて、空白を含むどの内容とも一致しない様にする
+    // (diff_cells, cell_key)。文字も端末に現れない U+0000 にしておく。
+    sgr0();
+    tcell_t unknown;
+    unknown.c = U'\0';
+    unknown.flags = tflag_unknown;
+    for (int i = 0; i < count; i++) {
+      int const y = resync_row;
+      resync_row = (resync_row + 1) % rows;
+      if (pixel_active && y < canvas.get_rows()) continue;
+      std::fill_n(&old_content[y * cols], cols, unknown);
+      dirty_mask.set(0, cols, y);
+    }
+    stats.resync_rows += count;
+  }
+
+public:
+  void draw_content() {
+    if (pixel_active) {
+      // 画像で覆っている範囲のセルは送らない
+      for (int y = 0; y < canvas.get_rows(); y++)
+        dirty_mask.reset(0, cols, y);
+    }
+    if (!pacer.next()) {
+      // 端末が追い付くまでフレームを間引く
+      stats.paced++;
+      process_signals();
+      return;
+    }
+    output_attempted = true;
+    if (!writer.wait_for(config::writer_grace_time)) {
+      // 端末への書き込みが終わっていないのでこのフレームは送らない
+      output_dropped = true;
+      stats.dropped++;
+      process_signals();
+      return;
+    }
+    stats.sent++;
+    if (self_test_active) self_test_snapshot();
+
+    std::size_t const mark = sync_update_begin();
+    resync_step();
+    if (scroll_request_dx) {
+      if (!pixel_active && std::abs(scroll_request_dx) < cols) {
+        scroll_t const scroll = detect_scroll(false, true, scroll_request_dx);
+        if (scroll.gain >= config::min_scroll_gain)
+          term_scroll(scroll);
+      }
+      scroll_request_dx = 0;
+    }
+    if (std::size_t const budget = frame_byte_budget()) {
+      draw_content_prioritized(budget, mark);
+      draw_pixels(budget);
+      sync_update_end(mark);
+      process_signals();
+      return;
+    }
+
+    // dirty_mask は変化し得るセルなので、先に差分を取って実際に変化したセルの割合で判断する
+    for (int y = 0; y < rows; y++) diff_row(y);
+    std::size_t const ncell = (std::size_t) cols * rows;
+    double const dirty_ratio = ncell ? (double) dirty_mask.count() / ncell : 0.0;
+    if (ncell && dirty_ratio >= config::full_repaint_ratio && !pixel_active) {
+      draw_content_full();
+      stats.full_frames++;
+      stats.full_dirty_ratio += dirty_ratio;
+      stats.full_bytes += out.size() - mark;
+      sync_update_end(mark);
+      process_signals();
+      return;
+    }
+
+    if (setting_scroll_region && !pixel_active) {
+      scroll_hint_update();
+      bool const dense = dirty_ratio >= config::scroll_detect_ratio;
+      if (scroll_hint_x || scroll_hint_y || dense) {
+        scroll_t const scroll = detect_scroll(scroll_hint_y || dense, scroll_hint_x || dense);
+        if (scroll.gain >= config::min_scroll_gain)
+          term_scroll(scroll);
+      }
+      scroll_hint_x = scroll_hint_y = false;
+    }
+    draw_content_ordered();
+    stats.diff_frames++;
+    stats.diff_dirty_ratio += dirty_ratio;
+    stats.diff_bytes += out.size() - mark;
+    draw_pixels(0);
+    sync_update_end(mark);
     process_signals();
   }
 
 private:
-  void clear_diffuse() {
+  // --pixel: フラクタルの場面を端末の画素の解像度で描いて画像として送る。
+  // 画像は最下行を除くセルを覆う (最下行まで描くと画像の後で端末がスクロールし得る)。
+  pixel_canvas_t canvas;
+  bool pixel_active = false;
+  int cell_width = 0, cell_height = 0; // 1セルの画素数 (0 は不明)
+
+  void pixel_resize() {
+    if (!pixel_active) return;
+    canvas.resize(cols, rows - 1,
+      cell_width > 0 ? cell_width : config::default_cell_width,
+      cell_height > 0 ? cell_height : config::default_cell_height);
+  }
+  void pixel_begin() {
+    if (setting_pixel_protocol == pixel_none || rows < 2) return;
+    pixel_active = true;
+    pixel_resize();
+    canvas.invalidate();
+  }
+  void pixel_end() {
+    if (!pixel_active) return;
+    pixel_active = false;
+    canvas.clear(out);
+
+    // 画像の下のセルは端末上では上書きされているので全て描き直す
+    px = py = -1;
+    draw_content_full();
+  }
+
+  // 背景 (0) 以外の色番号
+  byte pixel_level(double power) const {
+    int const n = canvas.palette.size();
+    return (byte) std::clamp<int>(std::round(power * (n - 1)), 1, n - 1);
+  }
+
+  // 変化したタイルを送る (budget = 0 は無制限)
+  void draw_pixels(std::size_t budget) {
+    if (!pixel_active) return;
+    std::size_t const mark = out.size();
+    int const ntile = canvas.flush(out, budget, [this] (int x, int y) {
+      goto_xy(x, y);
+      px = py = -1; // 画像を描いた後のカーソル位置は端末によって異なる
+    });
+    if (ntile) {
+      stats.pixel_frames++;
+      stats.pixel_tiles += ntile;
+      stats.pixel_bytes += out.size() - mark;
+    }
+  }
+
+private:
+  // 前のフレームで内容を設定した区画を空白に戻す
+  void clear_render_content() {
     for (int y = 0; y < rows; y++) {
-      for (int x = 0; x < cols; x++) {
-        std::size_t const index = y * cols + x;
-        tcell_t& tcell = new_content[index];
-        tcell.diffuse = 0;
-        tcell.bg = level_zero;
-      }
+      content_mask.for_each_span(y, [&] (int x1, int x2) {
+        for (int x = x1; x < x2; x++) {
+          new_content[y * cols + x] = tcell_t();
+          diffuse_plane[y * cols + x] = 0.0f;
+        }
+      });
+      dirty_mask.merge_row(content_mask, y);
+      content_mask.clear_row(y);
     }
   }
   void add_diffuse(int x, int y, double value) {
     if (0 <= y && y < rows && 0 <= x && x < cols && value > 0) {
-      std::size_t const index = y * cols + x;
-      tcell_t& tcell = new_content[index];
-      tcell.diffuse += value;
+      diffuse_plane[y * cols + x] += value;
+      content_mask.set(x, y);
     }
   }
   void resolve_diffuse() {
     for (int y = 0; y < rows; y++) {
-      for (int x = 0; x < cols; x++) {
-        std::size_t const index = y * cols + x;
-        tcell_t& tcell = new_content[index];
-        double const diffuse = std::min(0.04 * tcell.diffuse, 0.3);
-        tcell.bg = intensity2level(diffuse);
-      }
+      content_mask.for_each_span(y, [&] (int x1, int x2) {
+        for (int x = x1; x < x2; x++) {
+          tcell_t& tcell = new_content[y * cols + x];
+          if (tcell.c == half_block_upper) continue;
+          double const diffuse = std::min(0.04 * diffuse_plane[y * cols + x], 0.3);
+          tcell.bg = intensity2level(diffuse);
+        }
+      });
     }
   }
 
@@ -614,6 +2420,7 @@ private:
 
 private:
   colorspace_t m_colorspace = colorspace_xterm_256;
+  color_t m_color = index2color(47);
   std::vector<std::string> setfg_table;
   std::vector<std::string> setbg_table;
 
@@ -622,34 +2429,111 @@ private:
   std::size_t level_count;
   level_t intensity2level(double value) { return (level_t) ((level_count - 1) * value); }
 
-  void initialize_palette_rgb(color_t color) {
+  // 黒から color を経て白に至る色の列 (最大 255 段階)
+  static std::vector<color_t> color_ramp(color_t color) {
     std::vector<color_t> colors;
-    {
-      byte const R = 0xFF & color;
-      byte const G = 0xFF & color >> 8;
-      byte const B = 0xFF & color >> 16;
+    byte const R = 0xFF & color;
+    byte const G = 0xFF & color >> 8;
+    byte const B = 0xFF & color >> 16;
+
+    int const mx = std::max({R, G, B});
+    int const mn = std::min({R, G, B});
+
+    // 最大128レベル (0..254)
+    for (int i = 0; i <= mx; i += 2) {
+      byte const r = std::round(R * ((double) i / mx));
+      byte const g = std::round(G * ((double) i / mx));
+      byte const b = std::round(B * ((double) i / mx));
+      colors.push_back(r | g << 8 | b << 16);
+    }
 
-      int const mx = std::max({R, G, B});
-      int const mn = std::min({R, G, B});
+    // 最大127レベル {126..0}
+    int const n = (255 - mn) / 2;
+    for (int i = n - 1; i >= 0; i--) {
+      double const frac = (i * 2.0) / (255 - mn);
+      byte const r = std::round(255 - (255 - R) * frac);
+      byte const g = std::round(255 - (255 - G) * frac);
+      byte const b = std::round(255 - (255 - B) * frac);
+      colors.push_back(r | g << 8 | b << 16);
+    }
+    return colors;
+  }
 
-      // 最大128レベル (0..254)
-      for (int i = 0; i <= mx; i += 2) {
-        byte const r = std::round(R * ((double) i / mx));
-        byte const g = std::round(G * ((double) i / mx));
-        byte const b = std::round(B * ((double) i / mx));
-        colors.push_back(r | g << 8 | b << 16);
-      }
+  // --osc-palette: 色の列を 16 番以降の色番号に OSC 4 で設定して、番号の SGR で描画する。
+  // 色番号 0-15 は変更しないので、色の列が長い時は間引く。
+  static constexpr int palette_slot_begin = 16;
+  struct palette_slot_t {
+    int slot; // 色番号 (-1 ならば設定しない)
+    color_t color;
+  };
+  std::vector<palette_slot_t> palette_slots; // 各レベルの色番号と OSC 4 で設定する色
+  bool palette_programmed = false; // 端末の色番号を設定した (term_leave で OSC 104 で戻す)
+
+  void initialize_palette_osc(std::vector<color_t> colors) {
+    std::size_t const max_levels = 1 + (256 - palette_slot_begin);
+    if (colors.size() > max_levels) {
+      std::vector<color_t> sampled;
+      for (std::size_t i = 0; i < max_levels; i++)
+        sampled.push_back(colors[i * (colors.size() - 1) / (max_levels - 1)]);
+      colors.swap(sampled);
+    }
+    level_count = colors.size();
 
-      // 最大127レベル {126..0}
-      int const n = (255 - mn) / 2;
-      for (int i = n - 1; i >= 0; i--) {
-        double const frac = (i * 2.0) / (255 - mn);
-        byte const r = std::round(255 - (255 - R) * frac);
-        byte const g = std::round(255 - (255 - G) * frac);
-        byte const b = std::round(255 - (255 - B) * frac);
-        colors.push_back(r | g << 8 | b << 16);
+    const char* fmt_sgr = "\x1b[%c8;5;%dm";
+    if (m_colorspace != colorspace_xterm_rgb)
+      fmt_sgr = "\x1b[%c8:5:%dm";
+
+    char seq[100];
+    setfg_table.clear();
+    setbg_table.clear();
+    palette_slots.clear();
+    int slot = palette_slot_begin;
+    for (color_t color: colors) {
+      if (color == 0) {
+        palette_slots.push_back({-1, color});
+        setfg_table.push_back("\x1b[30m");
+        setbg_table.push_back("\x1b[40m");
+      } else {
+        palette_slots.push_back({slot, color});
+        std::sprintf(seq, fmt_sgr, '3', slot);
+        setfg_table.push_back(seq);
+        std::sprintf(seq, fmt_sgr, '4', slot++);
+        setbg_table.push_back(seq);
       }
     }
+  }
+  // OSC 4 ; c ; rgb:RR/GG/BB ; ... ST
+  void palette_program() {
+    if (palette_slots.empty()) return;
+    char spec[32];
+    out.write("\x1b]4");
+    for (auto const& [slot, color]: palette_slots) {
+      if (slot < 0) continue;
+      int const len = std::sprintf(spec, ";%d;rgb:%02x/%02x/%02x", slot, 0xFF & color, 0xFF & color >> 8, 0xFF & color >> 16);
+      out.write(spec, len);
+    }
+    out.write("\x1b\\");
+    palette_programmed = true;
+  }
+  // OSC 104 ; c ; ... ST (設定した色番号だけを端末の既定に戻す)
+  void palette_restore() {
+    if (!palette_programmed) return;
+    out.write("\x1b]104");
+    for (auto const& entry: palette_slots) {
+      if (entry.slot < 0) continue;
+      out.put(';');
+      out.put_dec(entry.slot);
+    }
+    out.write("\x1b\\");
+    palette_programmed = false;
+  }
+
+  void initialize_palette_rgb(color_t color) {
+    std::vector<color_t> const colors = color_ramp(color);
+    if (setting_osc_palette) {
+      initialize_palette_osc(colors);
+      return;
+    }
 
     level_count = colors.size();
 
@@ -843,7 +2727,9 @@ private:
 
 public:
   void initialize_color_table(color_t color, colorspace_t colorspace) {
+    this->m_color = color;
     this->m_colorspace = colorspace;
+    palette_slots.clear();
     switch (m_colorspace) {
     case colorspace_iso8613_6_rgb:
     case colorspace_iso8613_6_cmy:
@@ -864,6 +2750,20 @@ public:
       initialize_palette_ansi(color);
       break;
     }
+    initialize_tokens();
+    initialize_pixel_palette(color);
+  }
+
+private:
+  // 画像の色はセルの色の列と同じ輝度の対応で RGB で指定する (色番号 0 は背景)
+  void initialize_pixel_palette(color_t color) {
+    std::vector<color_t> const colors = color_ramp(color);
+    int const n = config::pixel_levels;
+    canvas.palette.assign(n, 0);
+    for (int i = 1; i < n; i++) {
+      double const level = util::interpolate((double) i / (n - 1), 0.6, colors.size());
+      canvas.palette[i] = colors[std::min<std::size_t>(level, colors.size() - 1)];
+    }
   }
 
 private:
@@ -876,9 +2776,9 @@ private:
     }
   }
 
-  cell_t const* rend_cell(int x, int y, double& power) {
+  cell_t const* rend_cell(int x, int y, double& power) const {
     cell_t const* ret = nullptr;
-    for (auto& layer: layers) {
+    for (auto const& layer: layers) {
       auto const& cell = layer.rcell(x, y);
       if (cell.c != ' ') {
         if (!ret) ret = &cell;
@@ -888,63 +2788,167 @@ private:
     return ret;
   }
 
+  row_mask_t lit_mask;
   void construct_render_content() {
-    clear_diffuse();
+    clear_render_content();
+    lit_mask.clear();
     for (int y = 0; y < rows; y++) {
-      for (int x = 0; x < cols; x++) {
-        std::size_t const index = y * cols + x;
-        tcell_t& tcell = new_content[index];
-
-        double current_power = 0.0;
-        cell_t const* lcell = this->rend_cell(x, y, current_power);
-        if (!lcell) {
-          tcell.c = ' ';
-          continue;
-        }
+      for (auto const& layer: layers)
+        layer.lit_columns(y, lit_mask);
+      lit_mask.for_each_span(y, [&] (int x1, int x2) {
+        for (int x = x1; x < x2; x++)
+          construct_render_cell(x, y);
+      });
+    }
 
-        tcell.c = lcell->c;
+    if (setting_diffuse_enabled)
+      resolve_diffuse();
+    if (setting_level_hysteresis > 0.0)
+      apply_level_hysteresis();
+    for (int y = 0; y < rows; y++)
+      dirty_mask.merge_row(content_mask, y);
+  }
 
-        // current_power = 現在の輝度 (瞬き)
-        if (m_twinkle_rendering != 0.0) {
-          current_power -= std::hypot(current_power * m_twinkle_rendering, 0.1) * util::randf();
-          if (current_power < 0.0) current_power = 0.0;
+  // --level-hysteresis: 瞬き・拡散で色番号が毎フレーム1段階程度揺らぐと SGR と文字を
+  // 書き直す必要があるので、表示する色番号は変化が閾値より大きい時か、目標の色番号との
+  // ずれの累積が閾値 x level_hysteresis_frames に達した時にだけ1段階変える。累積は
+  // 表示した色番号と目標の差の積分で、色番号を変えても飛ばしても捨てない。累積が閾値に
+  // 達したら目標を1段階越えた色番号を表示して返し、累積の符号が変わったら目標に戻す
+  // (明るくする時も暗くする時も同じ)。平均の明るさのずれは返し切れていない累積 (閾値
+  // 未満) だけになる。
+  struct level_filter_t {
+    int stamp = 0; // 最後に更新した時刻 (now)
+    level_t fg = 0;
+    level_t bg = 0;
+    float fg_error = 0.0f; // 目標の色番号との差の累積 (色番号 x フレーム)
+    float bg_error = 0.0f;
+    std::int8_t fg_repay = 0; // 累積を返している向き (+1: 目標より明るく表示中, -1: 暗く表示中)
+    std::int8_t bg_repay = 0;
+    bool lit = false; // 前のフレームで文字を表示した (fg が有効)
+  };
+  std::vector<level_filter_t> level_filters;
+
+  level_t filter_level(level_t& held, float& error, std::int8_t& repay, level_t target) const {
+    double const threshold = setting_level_hysteresis;
+    double const error_threshold = threshold * config::level_hysteresis_frames;
+    if (std::abs((int) target - (int) held) > threshold)
+      held = target;
+    float const next_error = error + ((int) target - (int) held); // 色番号を保った時の累積
+    int goal = held;
+    if (repay == 0) {
+      if (next_error >= error_threshold)
+        repay = 1;
+      else if (next_error <= -error_threshold)
+        repay = -1;
+    } else if (repay * next_error <= 0.0f) {
+      repay = 0;
+      goal = target;
+    }
+    if (repay)
+      goal = std::clamp<int>(target + repay, 0, level_count - 1);
+    if (goal > held)
+      held++;
+    else if (goal < held)
+      held--;
+    error += (int) target - (int) held;
+    return held;
+  }
+  void apply_level_hysteresis() {
+    for (int y = 0; y < rows; y++) {
+      content_mask.for_each_span(y, [&] (int x1, int x2) {
+        for (int x = x1; x < x2; x++) {
+          std::size_t const index = y * cols + x;
+          tcell_t& tcell = new_content[index];
+          level_filter_t& filter = level_filters[index];
+          if (filter.stamp != now - 1) {
+            // 前のフレームでは空白だったので目標の色番号から始める
+            filter = level_filter_t();
+            filter.bg = tcell.bg;
+          }
+          filter.stamp = now;
+
+          stats.level_target[1] += tcell.bg;
+          tcell.bg = filter_level(filter.bg, filter.bg_error, filter.bg_repay, tcell.bg);
+          stats.level_shown[1] += tcell.bg;
+          if (tcell.c != ' ') {
+            if (!filter.lit) {
+              // 新しく現れた文字は目標の色番号から始める
+              filter.fg = tcell.fg;
+              filter.lit = true;
+            }
+            stats.level_target[0] += tcell.fg;
+            tcell.fg = filter_level(filter.fg, filter.fg_error, filter.fg_repay, tcell.fg);
+            stats.level_shown[0] += tcell.fg;
+          } else {
+            filter.lit = false;
+            filter.fg_error = 0.0f;
+            filter.fg_repay = 0;
+          }
         }
+      });
+    }
+  }
 
-        // level = 色番号
-        double const fractional_level = util::interpolate(current_power, 0.6, level_count);
-        int level = fractional_level;
-        if (m_twinkle_rendering != 0.0 && util::randf() > fractional_level - level) level++;
-        level = std::min<int>(level, level_count - 1);
+  // 明るさ → 色番号 (瞬きの処理を含む)
+  int render_level(double current_power) const {
+    if (m_twinkle_rendering != 0.0) {
+      current_power -= std::hypot(current_power * m_twinkle_rendering, 0.1) * util::randf();
+      if (current_power < 0.0) current_power = 0.0;
+    }
+
+    double const fractional_level = util::interpolate(current_power, 0.6, level_count);
+    int level = fractional_level;
+    if (m_twinkle_rendering != 0.0 && util::randf() > fractional_level - level) level++;
+    return std::min<int>(level, level_count - 1);
+  }
 
-        tcell.fg = level;
-        tcell.bold = !(lcell->flags & cflag_disable_bold) && lcell->stage > 0.5;
+  void construct_render_cell(int x, int y) {
+    std::size_t const index = y * cols + x;
+    tcell_t& tcell = new_content[index];
 
-        if (!setting_diffuse_enabled) continue;
+    double current_power = 0.0;
+    cell_t const* lcell = this->rend_cell(x, y, current_power);
+    if (!lcell) return;
 
-        double const twinkle_power = (double) level / (level_count - 1);
-        double const p0 = ((1.0 / 0.3) * (twinkle_power - 0.0));
-        double const p1 = ((1.0 / 0.3) * (twinkle_power - 0.3));
-        double const p2 = ((1.0 / 0.5) * (twinkle_power - 0.7));
+    tcell.c = lcell->c;
+    content_mask.set(x, y);
 
-        tcell.diffuse += p0;
-        add_diffuse(x - 1, y, p1);
-        add_diffuse(x + 1, y, p1);
-        add_diffuse(x, y - 1, p1);
-        add_diffuse(x, y + 1, p1);
-        add_diffuse(x - 1, y - 1, p2);
-        add_diffuse(x + 1, y - 1, p2);
-        add_diffuse(x - 1, y + 1, p2);
-        add_diffuse(x + 1, y + 1, p2);
-      }
+    if (lcell->flags & cflag_half_block) {
+      // 上半分を前景色、下半分を背景色で表す (resolve_diffuse で背景色を上書きしない)
+      tcell.fg = render_level(lcell->current_power);
+      tcell.bg = render_level(lcell->current_lower_power);
+      tcell.bold = false;
+      return;
     }
 
-    if (setting_diffuse_enabled)
-      resolve_diffuse();
+    int const level = render_level(current_power);
+    tcell.fg = level;
+    tcell.bold = !(lcell->flags & cflag_disable_bold) && lcell->stage > 0.5;
+
+    if (!setting_diffuse_enabled || (lcell->flags & cflag_no_diffuse)) return;
+
+    double const twinkle_power = (double) level / (level_count - 1);
+    double const p0 = ((1.0 / 0.3) * (twinkle_power - 0.0));
+    double const p1 = ((1.0 / 0.3) * (twinkle_power - 0.3));
+    double const p2 = ((1.0 / 0.5) * (twinkle_power - 0.7));
+
+    diffuse_plane[index] += p0;
+    add_diffuse(x - 1, y, p1);
+    add_diffuse(x + 1, y, p1);
+    add_diffuse(x, y - 1, p1);
+    add_diffuse(x, y + 1, p1);
+    add_diffuse(x - 1, y - 1, p2);
+    add_diffuse(x + 1, y - 1, p2);
+    add_diffuse(x - 1, y + 1, p2);
+    add_diffuse(x + 1, y + 1, p2);
   }
 
 public:
   void render_direct() {
     now++;
+    // new_content が直接書き換えられたので全体を比較する
+    content_mask.fill();
+    dirty_mask.fill();
     this->draw_content();
   }
   void render_layers() {
@@ -961,22 +2965,118 @@ public:
   void term_leave() {
     if (!term_internal) return;
     term_internal = false;
-    std::fprintf(file, "\x18"); // CAN
-    std::fprintf(file, "\x1b[m\x1b[%dH\n", rows);
-    std::fprintf(file, "\x1b[?1049l\x1b[?25h");
-    std::fflush(file);
-    kreader.leave();
+    if (pixel_active) canvas.clear(out);
+    out.write("\x18"); // CAN
+    out.write("\x1b[m");
+    if (soft_font_active) out.write("\x0f\x1b)B"); // SI, G1 を ASCII に戻す
+    palette_restore();
+    out.put_csi(rows, 'H');
+    out.put('\n');
+    out.write("\x1b[?1049l\x1b[?25h\x1b[?7h");
+    // 端末が止まっている時にキー入力・シグナルの処理を止めない様に、待つ時間には上限を設ける。
+    // 書き終わらなかったフレームは捨てる (途中の制御機能は上の CAN で打ち切られる)。
+    writer.stop_for(config::writer_leave_timeout);
+    submit_output();
+    writer.stop_for(config::writer_leave_timeout);
+    if (!self_test_active) kreader.leave();
   }
   void term_enter() {
     if (term_internal) return;
     term_internal = true;
-    kreader.enter();
-    std::fprintf(file, "\x1b[?1049h\x1b[?25l");
+    if (!self_test_active) kreader.enter();
+    out.write("\x1b[?1049h\x1b[?25l\x1b[?7l");
+    if (setting_sync_update_detect)
+      out.write("\x1b[?2026$p"); // DECRQM
+    if (setting_scroll_region)
+      out.write("\x1b[?69$p"); // DECRQM (DECLRMM に対応していれば DECSLRM が使える)
+    if (setting_pixel_protocol != pixel_none)
+      out.write("\x1b[16t"); // XTWINOPS (セルの画素数を問い合わせる)
+    if (!term_probed && !self_test_active) term_probe();
+    if (setting_soft_font) {
+      // DECDLD は DA1 で対応を確認できた時だけ使う (self-test ではモデルが対応している)
+      soft_font_active = self_test_active || term_profile.drcs;
+      if (soft_font_active) soft_font_download();
+      initialize_tokens();
+    }
+    palette_program();
     sgr0();
     redraw();
-    std::fflush(file);
+    scheduler.reset();
+  }
+
+private:
+  term_profile_t term_profile;
+  bool term_probed = false;
+  bool probe_da1_received = false;
+
+  // term_probe で CPR を要求した項目 (応答が届く順)
+  enum probe_cpr_t {
+    probe_cpr_rep, // 空白1文字と REP 2回の後の位置
+    probe_cpr_ech, // ECH の後の位置
+    probe_cpr_count,
+  };
+  int probe_cpr_received = probe_cpr_count; // 受け取った CPR の数 (probe_cpr_count ならば待っていない)
+
+  // 端末に送った内容の後の DA1 の応答を待つ。送ってから応答までの時間 [秒] を返す。
+  // timeout までに応答がなければ負の値を返す。
+  double probe_round_trip(std::chrono::milliseconds timeout) {
+    using clock_type = std::chrono::steady_clock;
+    out.write("\x1b[c"); // DA1
+    probe_da1_received = false;
+    clock_type::time_point const start = clock_type::now();
+    submit_output();
+    for (;;) {
+      kreader.process();
+      clock_type::duration const elapsed = clock_type::now() - start;
+      if (probe_da1_received) return std::chrono::duration<double>(elapsed).count();
+      if (elapsed > timeout) return -1.0;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
   }
 
+  // 起動時に一度だけ端末の機能と転送速度を調べて term_profile に記録し、
+  // 出力の符号化・色の表・送るフレームの間隔の初期値に反映する。
+  void term_probe() {
+    term_probed = true;
+
+    // DCS の応答は DA1 の応答が届くまで受け付ける (process_report)
+    kreader.accept_dcs = true;
+    out.write("\x1b[0;38;5;196m\x1bP$qm\x1b\\\x1b[m"); // DECRQSS (256色の SGR が受理されたか)
+    out.write("\x1b[H \x1b[2b\x1b[6n");           // REP の後の位置を CPR で確認
+    out.write("\x1b[H\x1b[X\x1b[6n");             // ECH を知らずに文字を表示しないか CPR で確認
+    probe_cpr_received = 0;
+    out.write("\x1b[>0q");                          // XTVERSION
+    out.write("\x1b[>c");                           // DA2
+    double const round_trip = probe_round_trip(config::probe_timeout);
+    probe_cpr_received = probe_cpr_count;
+    if (round_trip < 0.0) return; // 応答しない端末では既定の設定を使う
+    term_profile.responded = true;
+    term_profile.round_trip = round_trip;
+
+    // 転送速度: 空白で画面を埋める内容を送って応答までの時間の増分を測る
+    for (int y = 0; out.size() < config::probe_throughput_bytes; y = (y + 1) % rows) {
+      out.put_csi(y + 1, 'H');
+      out.write(std::string(cols, ' ').c_str());
+    }
+    double const filler = out.size();
+    double const round_trip2 = probe_round_trip(config::probe_throughput_timeout);
+    double const elapsed = round_trip2 < 0.0 ?
+      std::chrono::duration<double>(config::probe_throughput_timeout).count() :
+      std::max(round_trip2 - round_trip, 0.001);
+    term_profile.throughput = filler / elapsed;
+
+    // 1フレームの内容を送れる間隔から始める
+    double const frame_bytes = cols * rows * config::typical_bytes_per_cell;
+    double const frame_interval = std::chrono::duration<double>(scheduler.frame_interval).count();
+    pacer.scale = std::clamp(frame_bytes / (term_profile.throughput * frame_interval), 1.0, output_pacer::max_scale);
+
+    // 256色の SGR が受理されなければ16色に切り替える
+    if (setting_colorspace_auto && term_profile.sgr_colors == 16 && m_colorspace != colorspace_aix_16)
+      initialize_color_table(m_color, colorspace_aix_16);
+  }
+
+public:
+
   bool is_menu = false;
   void process_key(key_t k) {
     switch (k) {
@@ -993,6 +3093,11 @@ public:
 #endif
     }
 
+    if (k == key_ctrl('l')) {
+      request_resync();
+      return;
+    }
+
     if (is_menu) {
       menu_process_key(k);
     } else {
@@ -1005,19 +3110,92 @@ public:
     }
   }
 
+  void process_report(byte final, std::string const& params) {
+    // 起動時の問い合わせ (term_probe) の応答
+    if (final == 'c' && params.size() && params[0] == '?') {
+      // DA1 (CSI ? Ps ; ... c): 最初の引数が 62 以上ならば VT220 以降
+      term_profile.da1_level = std::atoi(params.c_str() + 1);
+      for (std::size_t pos = params.find(';'); pos != std::string::npos; pos = params.find(';', pos + 1))
+        if (std::atoi(params.c_str() + pos + 1) == 7) term_profile.drcs = true; // 7: DRCS (DECDLD)
+      probe_da1_received = true;
+      probe_cpr_received = probe_cpr_count; // CPR は DA1 より先に届く
+      kreader.accept_dcs = false;
+    }
+    if (final == 'c' && params.size() && params[0] == '>')
+      term_profile.da2 = params.substr(1); // DA2 (CSI > Pp ; Pv ; Pc c)
+    // CPR (CSI Pl ; Pc R) は term_probe が応答を待っている間だけ受け付ける
+    int cpr_y, cpr_x;
+    if (final == 'R' && probe_cpr_received < probe_cpr_count &&
+      std::sscanf(params.c_str(), "%d;%d", &cpr_y, &cpr_x) == 2) {
+      switch (probe_cpr_received++) {
+      case probe_cpr_rep:
+        term_profile.rep = cpr_x == 4; // 空白1文字と REP 2回の後ならば4列目
+        break;
+      case probe_cpr_ech:
+        term_profile.ech = cpr_x == 1; // ECH はカーソルを動かさない
+        break;
+      }
+    }
+    if (final == 'P') {
+      if (params.compare(0, 2, ">|") == 0) {
+        term_profile.version = params.substr(2); // XTVERSION (DCS > | text ST)
+      } else if (params.compare(0, 3, "1$r") == 0 && params.back() == 'm') {
+        // DECRQSS (DCS 1 $ r Pt m ST): 256色の指定が残っていれば対応している。xterm などは
+        // 16 未満の色番号を 31・91 の形で返すので、16 以上の色番号 196 で確かめる。
+        // 解釈できない応答の時は sgr_colors を 0 (不明) のままにする。
+        std::string const sgr = ";" + params.substr(3, params.size() - 4) + ";";
+        bool const indexed = sgr.find(";38;5;196;") != std::string::npos || sgr.find(";38:5:196;") != std::string::npos;
+        term_profile.sgr_colors = indexed ? 256 : 16;
+      }
+    }
+
+    // DECRPM (CSI ? 2026 ; Ps $ y): Ps = 1, 2 ならば対応している
+    if (final == 'y' && setting_sync_update_detect) {
+      if (params == "?2026;1$" || params == "?2026;2$")
+        setting_sync_update = true;
+    }
+    if (final == 'y' && (params == "?69;1$" || params == "?69;2$"))
+      term_decslrm = true;
+
+    // XTWINOPS (CSI 6 ; height ; width t): セルの画素数
+    int height, width;
+    if (final == 't' && std::sscanf(params.c_str(), "6;%d;%d", &height, &width) == 2 && height > 0 && width > 0) {
+      cell_width = width;
+      cell_height = height;
+      pixel_resize();
+    }
+  }
+
   void initialize() {
     kreader.proc = [this] (key_t k) { this->process_key(k); };
+    kreader.report_proc = [this] (byte final, std::string const& params) { this->process_report(final, params); };
     term_get_size(this->cols, this->rows);
-    file = stdout;
+    term_get_cell_size(this->cell_width, this->cell_height);
+    initialize_content();
+  }
+  void initialize_content() {
     new_content.clear();
     new_content.resize(cols * rows);
+    diffuse_plane.assign(cols * rows, 0.0f);
+    level_filters.assign(cols * rows, level_filter_t());
+    scroll_request_dx = 0;
+    content_mask.resize(cols, rows);
+    dirty_mask.resize(cols, rows);
+    lit_mask.resize(cols, rows);
 
     for (auto& layer : layers)
       layer.resize(cols, rows);
+    pixel_resize();
   }
 
   void finalize() {
     this->term_leave();
+    if (setting_stats_enabled) {
+      setting_stats_enabled = false;
+      stats.print(stderr, pacer.scale, std::chrono::duration<double>(scheduler.frame_interval).count());
+      scheduler.print(stderr);
+      if (term_probed) term_profile.print(stderr);
+    }
   }
 
 
@@ -1202,7 +3380,6 @@ private:
     int render_height = glyph_definition_t::height;
     int min_progress = 0; // 最小の文字表示幅
 
-  private:
     static glyph_definition_t const* glyph_data(char32_t c) {
       static glyph_definition_t glyph_defs[] = {
 #include "glyph.inl"
@@ -1450,7 +3627,46 @@ private:
       if (is_menu) return;
     }
   }
-public:
+
+  // glyph の帯を1フレームに1列ずつ左に流す。各セルの文字は固定しておき、帯全体が
+  // 単純にずれる様にする。ずれは request_hscroll で伝えるので、端末上では帯の行を
+  // ICH/DCH または SL/SR で移動してから新しく現れた列だけを書き込む。
+  void s2banner_show_marquee(banner_message_t& message) {
+    int width = 0;
+    for (glyph_t const& g: message.glyphs) width += g.render_width;
+    std::vector<char32_t> chars(width * s2banner_cell_height);
+    for (char32_t& c: chars) c = util::rand_char();
+
+    int const y0 = (rows - s2banner_cell_height) / 2;
+    int const loop_max = cols + width;
+    for (int loop = 0; loop <= loop_max; loop++) {
+      for (int y = 0; y < s2banner_cell_height; y++)
+        for (int x = 0; x < cols; x++)
+          s2banner_put_char(x, y0, 0, y, 0, ' ');
+
+      int x0 = cols - loop, offset = 0;
+      for (glyph_t const& g: message.glyphs) {
+        int const x1 = x0 + (g.render_width - 1 - g.w) / 2;
+        if (x1 + g.w > 0 && x1 < cols) {
+          for (int y = 0; y < g.h; y++) {
+            for (int x = std::max(0, -x1); x < g.w && x1 + x < cols; x++)
+              if (g(x, y))
+                s2banner_put_char(x1 + x, y0, 0, y, 1, chars[(offset + x) * s2banner_cell_height + y]);
+          }
+        }
+        x0 += g.render_width;
+        offset += g.render_width;
+      }
+
+      s2banner_add_thread(1, 2000);
+      render_layers();
+      if (loop > 0) request_hscroll(-1);
+      next_frame();
+      kreader.process();
+      if (is_menu) return;
+    }
+  }
+
 public:
   void s2banner_add_message(std::string const& message) {
     banner.add_message(message);
@@ -1459,35 +3675,61 @@ public:
     // mode = 0: glyph を使って表示
     // mode = 1: 単純に文字を並べる
     // mode = 2: 1文字ずつ空白を空けて文字を並べる
+    // mode = 3: glyph を右から左に流す (画面の幅に収まらない時)
     int mode = 1;
     if (banner.max_min_width() < cols) {
       mode = 0;
+    } else if (rows >= s2banner_cell_height) {
+      mode = 3;
     } else if (banner.max_number_of_characters() * 2 < cols) {
       mode = 2;
     }
 
-    for (banner_message_t& message: banner)
-      s2banner_show_message(message, mode);
+    for (banner_message_t& message: banner) {
+      if (mode == 3)
+        s2banner_show_marquee(message);
+      else
+        s2banner_show_message(message, mode);
+    }
   }
 
 private:
+  // フラクタル・ライフゲームの場面で点灯しているセルの文字。--stable-glyphs の時は
+  // 点灯し続けるセルの文字を保つ (文字の変化は layer_t::resolve_level の error_rate に任せる)。
+  char32_t fractal_char(cell_t const& cell) const {
+    if (setting_stable_glyphs && cell.c != ' ' && !(cell.flags & cflag_fixed_char))
+      return cell.c;
+    return util::rand_char();
+  }
+
   conway_t s4conway_board;
   void s4conway_frame(double theta, double scal, double power) {
+    if (pixel_active) {
+      s4conway_frame_pixels(theta, scal, power);
+      return;
+    } else if (setting_subcell == subcell_half) {
+      s4conway_frame_half(theta, scal, power);
+      return;
+    } else if (setting_subcell == subcell_braille) {
+      s4conway_frame_braille(power);
+      return;
+    }
     s4conway_board.set_size(cols, rows);
+    s4conway_board.set_unit(1.0, 1.0);
     s4conway_board.set_transform(scal, theta);
     for (int y = 0; y < rows; y++) {
       for (int x = 0; x < cols; x++) {
         cell_t& cell = layers[2].rcell(x, y);
         switch (s4conway_board.get_pixel(x, y, power)) {
         case 1:
-          cell.c = util::rand_char();
+          cell.c = fractal_char(cell);
           cell.birth = now;
           cell.power = power;
           cell.decay = 100;
           cell.flags = cflag_disable_bold;
           break;
         case 2:
-          cell.c = util::rand_char();
+          cell.c = fractal_char(cell);
           cell.birth = now;
           cell.power = power * 0.2;
           cell.decay = 100;
@@ -1500,8 +3742,83 @@ private:
       }
     }
   }
+  void s4conway_frame_half(double theta, double scal, double power) {
+    s4conway_board.set_size(cols, rows * 2);
+    s4conway_board.set_unit(1.0, 0.5);
+    s4conway_board.set_transform(scal, theta);
+    auto const pixel_power = [&] (int x, int y) {
+      switch (s4conway_board.get_pixel(x, y, power)) {
+      case 1: return power;
+      case 2: return power * 0.2;
+      default: return 0.0;
+      }
+    };
+    for (int y = 0; y < rows; y++) {
+      for (int x = 0; x < cols; x++) {
+        cell_t& cell = layers[2].rcell(x, y);
+        double const upper = pixel_power(x, 2 * y);
+        double const lower = pixel_power(x, 2 * y + 1);
+        if (upper == 0.0 && lower == 0.0) {
+          cell.c = ' ';
+        } else {
+          cell.c = half_block_upper;
+          cell.birth = now;
+          cell.power = upper;
+          cell.lower_power = lower;
+          cell.decay = 100;
+          cell.flags = cflag_disable_bold | cflag_half_block | cflag_fixed_char;
+        }
+      }
+    }
+  }
+  // 盤面の点をそのまま点字の点として中央に表示する (回転・拡大はしない)
+  void s4conway_frame_braille(double power) {
+    int const x0 = (s4conway_board.width - 2 * cols) / 4;
+    int const y0 = (s4conway_board.height - 4 * rows) / 8;
+    s4conway_board.pack_bits();
+    for (int y = 0; y < rows; y++) {
+      for (int x = 0; x < cols; x++) {
+        cell_t& cell = layers[2].rcell(x, y);
+        byte const dots = s4conway_board.get_braille(x0 + x, y0 + y);
+        if (!dots) {
+          cell.c = ' ';
+        } else {
+          cell.c = glyph_table_braille + dots;
+          cell.birth = now;
+          cell.power = power;
+          cell.decay = 100;
+          cell.flags = cflag_disable_bold | cflag_fixed_char | cflag_no_diffuse;
+        }
+      }
+    }
+  }
+  void s4conway_frame_pixels(double theta, double scal, double power) {
+    int const width = canvas.width(), height = canvas.height();
+    s4conway_board.set_size(width, height);
+    s4conway_board.set_unit(1.0 / canvas.get_cell_width(), 1.0 / canvas.get_cell_height());
+    s4conway_board.set_transform(scal, theta);
+    byte const level1 = pixel_level(power);
+    byte const level2 = pixel_level(power * 0.2);
+    for (int y = 0; y < height; y++) {
+      byte* const line = canvas.row(y);
+      for (int x = 0; x < width; x++) {
+        switch (s4conway_board.get_pixel(x, y, power)) {
+        case 1: line[x] = level1; break;
+        case 2: line[x] = level2; break;
+        default: line[x] = 0; break;
+        }
+      }
+    }
+    for (int y = 0; y < rows; y++)
+      for (int x = 0; x < cols; x++)
+        layers[2].rcell(x, y).c = ' ';
+  }
 public:
   void s4conway() {
+    if (!pixel_active && setting_subcell == subcell_braille)
+      s4conway_board.set_board_size(std::max(128, 2 * cols), std::max(128, 4 * rows));
+    else
+      s4conway_board.set_board_size(128, 128);
     s4conway_board.initialize();
     double time = 0.0;
     double distance = 0.48;
@@ -1522,6 +3839,14 @@ public:
 private:
   mandelbrot_t s5mandel_data;
   void s5mandel_frame(double theta, double scale, double power_scale) {
+    if (pixel_active) {
+      s5mandel_frame_pixels(theta, scale, power_scale);
+      return;
+    } else if (setting_subcell != subcell_none) {
+      s5mandel_frame_half(theta, scale, power_scale);
+      return;
+    }
+    s5mandel_data.set_unit(0.5, 1.0, 5);
     s5mandel_data.resize(cols, rows);
     s5mandel_data.update_frame(theta, scale);
     for (int y = 0; y < rows; y++) {
@@ -1531,7 +3856,7 @@ private:
         if (power < 0.05) {
           cell.c = ' ';
         } else {
-          cell.c = util::rand_char();
+          cell.c = fractal_char(cell);
           cell.birth = now;
           cell.power = power * power_scale;
           cell.decay = 100;
@@ -1541,6 +3866,61 @@ private:
     }
   }
 
+  void s5mandel_frame_half(double theta, double scale, double power_scale) {
+    s5mandel_data.set_unit(0.5, 0.5, 5);
+    s5mandel_data.resize(cols, rows * 2);
+    s5mandel_data.update_frame(theta, scale);
+    auto const point_power = [&] (int x, int y) {
+      double const power = s5mandel_data(x, y);
+      return power < 0.05 ? 0.0 : power * power_scale;
+    };
+    for (int y = 0; y < rows; y++) {
+      for (int x = 0; x < cols; x++) {
+        cell_t& cell = layers[1].rcell(x, y);
+        double const upper = point_power(x, 2 * y);
+        double const lower = point_power(x, 2 * y + 1);
+        if (upper == 0.0 && lower == 0.0) {
+          cell.c = ' ';
+        } else {
+          cell.c = half_block_upper;
+          cell.birth = now;
+          cell.power = upper;
+          cell.lower_power = lower;
+          cell.decay = 100;
+          cell.flags = cflag_disable_bold | cflag_half_block | cflag_fixed_char;
+        }
+      }
+    }
+  }
+
+  std::vector<byte> s5mandel_levels;
+  void s5mandel_frame_pixels(double theta, double scale, double power_scale) {
+    int const width = canvas.width(), height = canvas.height();
+
+    // 点が多過ぎると計算が追い付かないので step x step 画素毎に1点を取る。
+    // 点が密なので前フレームからの補間の標本は少なくする。
+    int const step = std::max<int>(1, std::ceil(std::sqrt((double) width * height / config::max_mandel_points)));
+    int const mcols = (width + step - 1) / step, mrows = (height + step - 1) / step;
+    s5mandel_data.set_unit(0.5 * step / canvas.get_cell_width(), 1.0 * step / canvas.get_cell_height(), 2);
+    s5mandel_data.resize(mcols, mrows);
+    s5mandel_data.update_frame(theta, scale);
+
+    s5mandel_levels.resize(mcols);
+    for (int my = 0; my < mrows; my++) {
+      for (int mx = 0; mx < mcols; mx++) {
+        double const power = s5mandel_data(mx, my);
+        s5mandel_levels[mx] = power < 0.05 ? 0 : pixel_level(power * power_scale);
+      }
+      for (int y = my * step; y < std::min(height, (my + 1) * step); y++) {
+        byte* const line = canvas.row(y);
+        for (int x = 0; x < width; x++)
+          line[x] = s5mandel_levels[x / step];
+      }
+    }
+    for (int y = 0; y < rows; y++)
+      for (int x = 0; x < cols; x++)
+        layers[1].rcell(x, y).c = ' ';
+  }
 public:
   void s5mandel() {
     set_twinkle(0.1);
@@ -1655,10 +4035,14 @@ public:
       this->s3rain(2800, buffer::s3rain_scroll_func_tanh);
       break;
     case scene_conway:
+      this->pixel_begin();
       this->s4conway();
+      this->pixel_end();
       break;
     case scene_mandelbrot:
+      this->pixel_begin();
       this->s5mandel();
+      this->pixel_end();
       break;
     case scene_rain_forever:
       this->s3rain(0, buffer::s3rain_scroll_func_const);
@@ -1670,8 +4054,223 @@ public:
       break;
     }
   }
+
+  // --self-test: 端末の代わりに vt_model_t に出力を送って各場面を全ての色空間で実行し、
+  // 各フレームの後でモデルの画面が old_content (送った内容) に一致するか確かめる。
+  // conway と mandelbrot は半角ブロック (--subcell=half) でも実行する。
+  // --pixel の時は画像もモデルで復号して送った画素と比べる。
+  // フレームを全て送った時 (バイト数の制限がない時) は、場面が描いた内容
+  // (diff_cells が書き換える前の new_content の写し) とも比較する。
+private:
+  bool self_test_active = false;
+  vt_model_t self_test_model;
+  std::vector<char> self_test_data;
+  std::vector<tcell_t> self_test_scene; // draw_content の前の new_content
+  bool self_test_scene_taken = false;   // このフレームで self_test_scene を取った
+  std::vector<int> self_test_fg, self_test_bg; // 色番号 → モデルの色
+  int self_test_remaining = 0; // 場面の残りのフレーム数
+  long self_test_count = 0;
+  long self_test_mismatches = 0;
+
+  bool self_test_match(tcell_t const& tcell, vt_model_t::vt_cell_t const& cell) const {
+    if (tcell.flags & tflag_unknown) return true; // 内容が不明なセル (resync_step)
+    int const fg = self_test_fg[tcell.fg], bg = self_test_bg[tcell.bg];
+    if (tcell.c == half_block_upper) {
+      // half_block_form で選ばれ得る形
+      return (cell.c == half_block_upper && !cell.bold && cell.fg == fg && cell.bg == bg) ||
+        (cell.c == half_block_lower && !cell.bold && cell.fg == self_test_fg[tcell.bg] && cell.bg == self_test_bg[tcell.fg]) ||
+        (tcell.fg == tcell.bg && cell.c == U' ' && cell.bg == bg) ||
+        (tcell.fg == tcell.bg && cell.c == full_block && !cell.bold && cell.fg == fg);
+    }
+    if ((cell.c != tcell.c && !self_test_match_soft_glyph(tcell.c, cell.c)) || cell.bg != bg) return false;
+    return tcell.c == U' ' || (cell.fg == fg && cell.bold == tcell.bold);
+  }
+  // DECDLD で登録した文字は、モデルが受け取った画素が glyph.def の形と一致するか確認する
+  bool self_test_match_soft_glyph(char32_t c, char32_t model_c) const {
+    glyph_token_t const glyph = glyph_token(c);
+    if (glyph.shift != glyph_shift_g1) return false;
+    byte const code = glyph.data[0];
+    return model_c == vt_model_t::soft_char_base + code &&
+      self_test_model.soft_glyph(code) == soft_glyphs[code - 0x21].rows;
+  }
+  // 場面が描いた内容との比較では、self_test_match の同一視に加えて、
+  // 前景色が背景色と同じ雨の文字 (diff_cells で空白に置き換わる) を空白と同一視する。
+  bool self_test_match_scene(tcell_t const& tcell, vt_model_t::vt_cell_t const& cell) const {
+    if (self_test_match(tcell, cell)) return true;
+    return tcell.fg == tcell.bg && is_rain_glyph(tcell.c) &&
+      cell.c == U' ' && cell.bg == self_test_bg[tcell.bg];
+  }
+  void self_test_snapshot() {
+    self_test_scene = new_content;
+    self_test_scene_taken = true;
+  }
+  long self_test_compare(std::vector<tcell_t> const& content, const char* name, bool scene = false) {
+    long mismatches = 0;
+    for (int y = pixel_active ? canvas.get_rows() : 0; y < rows; y++) {
+      for (int x = 0; x < cols; x++) {
+        tcell_t const& tcell = content[y * cols + x];
+        vt_model_t::vt_cell_t const& cell = self_test_model.cell(x, y);
+        if (scene ? self_test_match_scene(tcell, cell) : self_test_match(tcell, cell)) continue;
+        if (self_test_mismatches + mismatches < 10) {
+          std::fprintf(stderr, "cxxmatrix: self-test: frame %ld (%d, %d): %s has U+%04X fg=%d bg=%d bold=%d, "
+            "but the terminal has U+%04X fg=%s bg=%s bold=%d\n",
+            self_test_count, x, y, name, (unsigned) tcell.c, tcell.fg, tcell.bg, tcell.bold,
+            (unsigned) cell.c, self_test_model.color_name(cell.fg).c_str(),
+            self_test_model.color_name(cell.bg).c_str(), cell.bold);
+        }
+        mismatches++;
+      }
+    }
+    return mismatches;
+  }
+  // 画像は端末に送ったタイル (pixel_canvas_t::shown_row) がモデルで復号した画素と一致するか確かめる
+  long self_test_compare_pixels() {
+    if (!pixel_active) return 0;
+    bool const sixel = canvas.get_protocol() == pixel_sixel;
+    std::vector<std::uint32_t> expected(canvas.palette);
+    if (sixel) {
+      for (std::uint32_t& color: expected)
+        color = vt_model_t::sixel_color(
+          sixel_encoder_t::percent(0xFF & color),
+          sixel_encoder_t::percent(0xFF & color >> 8),
+          sixel_encoder_t::percent(0xFF & color >> 16));
+    }
+
+    long mismatches = 0;
+    for (int y = 0; y < canvas.height(); y++) {
+      byte const* const shown = canvas.shown_row(y);
+      for (int x = 0; x < canvas.width(); x++) {
+        if (x % canvas.tile_width() == 0 && !canvas.is_shown(x, y)) {
+          x += canvas.tile_width() - 1;
+          continue;
+        }
+        byte const index = shown[x];
+        std::uint32_t const color = self_test_model.pixel(x, y);
+        if (color == expected[index]) continue;
+        if (self_test_mismatches + mismatches < 10) {
+          std::fprintf(stderr, "cxxmatrix: self-test: frame %ld pixel (%d, %d): canvas has #%06X, but the terminal has %s%06X\n",
+            self_test_count, x, y, (unsigned) expected[index],
+            color == vt_model_t::no_pixel ? "no image " : "#", color == vt_model_t::no_pixel ? 0u : (unsigned) color);
+        }
+        mismatches++;
+      }
+    }
+    return mismatches;
+  }
+  void self_test_frame() {
+    self_test_count++;
+    self_test_mismatches += self_test_compare(old_content, "old_content");
+    self_test_mismatches += self_test_compare_pixels();
+    if (self_test_scene_taken && !frame_byte_budget())
+      self_test_mismatches += self_test_compare(self_test_scene, "scene", true);
+    self_test_scene_taken = false;
+    if (--self_test_remaining <= 0) is_menu = true; // 場面を抜ける
+  }
+
+public:
+  bool self_test(color_t color, std::vector<scene_t> const& scenes) {
+    static constexpr std::pair<colorspace_t, const char*> colorspaces[] = {
+      {colorspace_ansi_8, "ansi-8"},
+      {colorspace_aix_16, "aix-16"},
+      {colorspace_xterm_88, "xterm-88"},
+      {colorspace_xterm_256, "xterm-256"},
+      {colorspace_xterm_rgb, "xterm-rgb"},
+      {colorspace_iso8613_6_rgb, "iso-rgb"},
+      {colorspace_iso8613_6_cmy, "iso-cmy"},
+      {colorspace_iso8613_6_cmyk, "iso-cmyk"},
+      {colorspace_iso8613_6_index, "iso-index"},
+    };
+
+    self_test_active = true;
+    term_profile.rep = true; // REP の出力も確認する
+    cols = config::self_test_cols;
+    rows = config::self_test_rows;
+    initialize_content();
+
+    bool result = true;
+    for (auto const& [colorspace, name]: colorspaces) {
+      util::rand_engine().seed(colorspace);
+      initialize_color_table(color, colorspace);
+      self_test_model.set_cell_size(
+        cell_width > 0 ? cell_width : config::default_cell_width,
+        cell_height > 0 ? cell_height : config::default_cell_height);
+      self_test_model.resize(cols, rows);
+      self_test_fg.clear();
+      self_test_bg.clear();
+      for (std::size_t level = 0; level < level_count; level++) {
+        std::string fg = setfg_table[level], bg = setbg_table[level];
+        if (palette_slots.size() && palette_slots[level].slot >= 0) {
+          // OSC 4 で設定した色番号は RGB で指定したのと同じ色になる筈
+          color_t const color = palette_slots[level].color;
+          char seq[64];
+          std::sprintf(seq, "\x1b[38;2;%d;%d;%dm", 0xFF & color, 0xFF & color >> 8, 0xFF & color >> 16);
+          fg = seq;
+          seq[2] = '4';
+          bg = seq;
+        }
+        self_test_fg.push_back(self_test_model.sgr_color(fg, true));
+        self_test_bg.push_back(setting_preserve_background && level == (std::size_t) level_background ? 0 :
+          self_test_model.sgr_color(bg, false));
+      }
+
+      self_test_count = 0;
+      self_test_mismatches = 0;
+      term_enter();
+      for (scene_t const s: scenes) {
+        if (s == scene_loop || s == scene_exit) continue;
+        self_test_remaining = config::self_test_frames;
+        scene(s);
+        is_menu = false;
+
+        // 半角ブロックの表示は --subcell を指定しなくても確かめる
+        if ((s == scene_conway || s == scene_mandelbrot) &&
+          setting_subcell == subcell_none && setting_pixel_protocol == pixel_none) {
+          set_subcell(subcell_half);
+          self_test_remaining = config::self_test_frames;
+          scene(s);
+          is_menu = false;
+          set_subcell(subcell_none);
+        }
+      }
+      term_leave();
+
+      std::string const& error = self_test_model.error();
+      std::printf("%-10s %5ld frames, %ld mismatches%s%s\n", name, self_test_count, self_test_mismatches,
+        error.empty() ? "" : ", unknown control function: ", error.c_str());
+      if (self_test_mismatches || !error.empty()) result = false;
+    }
+    self_test_active = false;
+    return result;
+  }
 };
 
+buffer::tcell_bits_t const buffer::tcell_bits = [] {
+  auto value = [] (tcell_t const& tcell) {
+    std::uint64_t value;
+    std::memcpy(&value, &tcell, sizeof value);
+    return value;
+  };
+  tcell_t tcell;
+  tcell.c = 0;
+
+  tcell_bits_t bits;
+  tcell.fg = 1;
+  bits.fg_shift = util::countr_zero(value(tcell));
+  tcell.fg = 0;
+  tcell.bg = 1;
+  bits.bg_shift = util::countr_zero(value(tcell));
+  tcell.bg = 0;
+  tcell.flags = 0xFF;
+  bits.flags = value(tcell);
+  tcell.flags = 0;
+  tcell.c = U' ';
+  bits.blank = value(tcell);
+  tcell.c = ~char32_t(0);
+  bits.c = value(tcell);
+  bits.blank_key = bits.c | bits.flags | std::uint64_t(0xFF) << bits.bg_shift;
+  return bits;
+}();
+
 buffer buff;
 
 void trapint(int) {
@@ -1682,15 +4281,11 @@ void trapwinch(int) {
 }
 
 #ifdef SIGTSTP
-void traptstp(int sig) {
-  buff.term_leave();
-  std::signal(sig, SIG_DFL);
-  std::raise(sig);
+void traptstp(int) {
+  buff.notify_tstp();
 }
 void trapcont(int) {
-  buff.term_enter();
-  buff.notify_winch();
-  std::signal(SIGTSTP, traptstp);
+  buff.notify_cont();
 }
 #endif
 
@@ -1710,7 +4305,8 @@ public:
       "\n"
       "MESSAGE\n"
       "   Add a message for 'banner' scene.  When no messages are specified, a\n"
-      "   message \"C++ MATRIX\" will be used.\n"
+      "   message \"C++ MATRIX\" will be used.  Messages wider than the terminal\n"
+      "   scroll from right to left.\n"
       "\n"
       //------------------------------------------------------------------------------
       "OPTIONS\n"
@@ -1729,7 +4325,8 @@ public:
       "               Set colorspace. One of 'default'/'xterm-256'/'256',\n"
       "               'ansi-8'/'8', 'aix-16'/'16', 'xterm-88'/'88', 'xterm-rgb',\n"
       "               'iso-rgb'/'rgb', 'iso-cmy'/'cmy', 'iso-cmyk'/'cmyk', or\n"
-      "               'iso-index'/'index'.\n"
+      "               'iso-index'/'index'.  With 'default', 'aix-16' is used\n"
+      "               when the terminal rejects 256-color SGR (DECRQSS).\n"
       "   --frame-rate=NUM\n"
       "               Set the frame rate per second.  A positive number less than or\n"
       "               equal to 1000.  The default is 25.\n"
@@ -1748,6 +4345,63 @@ public:
       "   --rain-density=NUM\n"
       "               Set the factor for the density of rain drops.  A positive\n"
       "               number.  The default is 1.0.\n"
+      "   --level-hysteresis=NUM\n"
+      "               Keep the color levels of cells unless they change by more\n"
+      "               than NUM levels or the difference lasts for several\n"
+      "               frames.  A non-negative number.  The default is 1.0.  0\n"
+      "               updates the levels in every frame.\n"
+      "   --stable-glyphs\n"
+      "   --no-stable-glyphs\n"
+      "               Turn on/off keeping the characters of lit cells in 'conway'\n"
+      "               and 'mandelbrot' scenes.  The characters are changed at the\n"
+      "               error rate (default: off).\n"
+      "   --soft-font\n"
+      "   --no-soft-font\n"
+      "               Turn on/off downloading the glyphs of the rain characters\n"
+      "               by DECDLD and sending them as single bytes in G1 when the\n"
+      "               terminal reports DRCS support in DA1 (default: off).\n"
+      "   --osc-palette\n"
+      "   --no-osc-palette\n"
+      "               Turn on/off setting the colors of 'xterm-rgb', 'iso-rgb',\n"
+      "               'iso-cmy' and 'iso-cmyk' to the palette entries 16-255 by\n"
+      "               OSC 4 and drawing with indexed SGR (default: off).  The\n"
+      "               palette is restored by OSC 104 on exit.\n"
+      "   --max-bytes-per-frame=NUM\n"
+      "               Limit the number of bytes sent to the terminal in a frame.\n"
+      "               Changed cells are sent in order of importance, and the rest\n"
+      "               are sent in later frames.  The default is 0 (unlimited).\n"
+      "   --link-bps=NUM\n"
+      "               Limit the bytes per frame so that the output fits in a link\n"
+      "               of NUM bits per second.  The default is 0 (unlimited).\n"
+      "   --sync-update\n"
+      "   --no-sync-update\n"
+      "               Turn on/off synchronized update (DEC mode 2026).  By default,\n"
+      "               it is turned on when the terminal reports its support.\n"
+      "   --scroll-region\n"
+      "   --no-scroll-region\n"
+      "               Turn on/off moving the terminal contents by scrolling when\n"
+      "               the screen shifts (default: on).  Horizontal shifts use SL/SR\n"
+      "               when the terminal reports DECSLRM support, or ICH/DCH.\n"
+      "               Long banner messages are shifted by ICH/DCH even when off.\n"
+      "   --resync-rows=NUM\n"
+      "               Rewrite NUM rows per frame in turn regardless of the contents\n"
+      "               assumed on the terminal, so that the screen recovers from\n"
+      "               damage by other output.  The default is 0 (off).\n"
+      "   --pixel=PROTOCOL\n"
+      "               Draw 'conway' and 'mandelbrot' scenes at the pixel resolution\n"
+      "               of the terminal as images.  One of 'none' (default), 'sixel'\n"
+      "               and 'kitty'.\n"
+      "   --subcell=MODE\n"
+      "               Draw 'conway' and 'mandelbrot' scenes with several samples\n"
+      "               in a cell.  One of 'none' (default), 'half' (upper and lower\n"
+      "               halves by U+2580/U+2584) and 'braille' (2x4 board cells by\n"
+      "               U+2800-U+28FF in 'conway', 'half' in 'mandelbrot').\n"
+      "   --stats     Print the frame rate, the frame timing and jitter, the\n"
+      "               output backlog, the write latency and the terminal\n"
+      "               capabilities found at startup to stderr on exit.\n"
+      "   --self-test Run the scenes in every colorspace against a model of the\n"
+      "               terminal instead of the terminal, and check that the output\n"
+      "               reproduces the screen contents after each frame.\n"
       "\n"
       "Keyboard\n"
       "   C-c (SIGINT), q, Q  Quit\n"
@@ -1755,6 +4409,7 @@ public:
       "   C-z (SIGTSTP)       Suspend\n"
 #endif
       "   C-m, RET            Show menu\n"
+      "   C-l                 Rewrite the whole screen over 8 frames\n"
       "\n"
     );
   }
@@ -1846,6 +4501,7 @@ private:
 public:
   color_t color = index2color(47);
   colorspace_t colorspace = colorspace_xterm_256;
+  bool flag_colorspace_auto = true; // --colorspace が指定されていない
 
 private:
   int xdigit2i(char c) {
@@ -1915,6 +4571,7 @@ private:
   }
   void set_colorspace(const char* name) {
     std::string_view view = name;
+    flag_colorspace_auto = view == "default";
     if (view == "ansi-8" || view == "8") {
       this->colorspace = colorspace_ansi_8;
       return;
@@ -1950,14 +4607,59 @@ private:
     std::fprintf(stderr, "cxxmatrix: unknown colorspace (%s)\n", view.data());
     flag_error = true;
   }
+  void set_pixel_protocol(const char* name) {
+    std::string_view view = name;
+    if (view == "none") {
+      this->pixel_protocol = pixel_none;
+      return;
+    } else if (view == "sixel") {
+      this->pixel_protocol = pixel_sixel;
+      return;
+    } else if (view == "kitty") {
+      this->pixel_protocol = pixel_kitty;
+      return;
+    }
+
+    std::fprintf(stderr, "cxxmatrix: unknown pixel protocol (%s)\n", view.data());
+    flag_error = true;
+  }
+  void set_subcell(const char* name) {
+    std::string_view view = name;
+    if (view == "none") {
+      this->subcell = subcell_none;
+      return;
+    } else if (view == "half") {
+      this->subcell = subcell_half;
+      return;
+    } else if (view == "braille") {
+      this->subcell = subcell_braille;
+      return;
+    }
+
+    std::fprintf(stderr, "cxxmatrix: unknown subcell mode (%s)\n", view.data());
+    flag_error = true;
+  }
 
 public:
   bool flag_diffuse_enabled = true;
   bool flag_twinkle_enabled = true;
   bool flag_preserve_background = false;
+  int flag_sync_update = -1; // -1: auto
+  bool flag_scroll_region = true;
+  bool flag_stats = false;
+  bool flag_self_test = false;
+  pixel_protocol_t pixel_protocol = pixel_none;
+  subcell_t subcell = subcell_none;
   double frame_rate = 25;
   double error_rate = 1.0;
   double rain_density = 1.0;
+  double level_hysteresis = 1.0;
+  bool flag_stable_glyphs = false;
+  bool flag_soft_font = false;
+  bool flag_osc_palette = false;
+  std::size_t max_bytes_per_frame = 0;
+  int resync_rows = 0;
+  double link_bps = 0.0;
 private:
   void set_frame_rate(const char* frame_rate_text) {
     if (std::isdigit(frame_rate_text[0])) {
@@ -1996,6 +4698,50 @@ private:
     flag_error = true;
   }
 
+  void set_level_hysteresis(const char* level_hysteresis_text) {
+    if (std::isdigit(level_hysteresis_text[0])) {
+      double const value = std::atof(level_hysteresis_text);
+      if (0.0 <= value) {
+        this->level_hysteresis = value;
+        return;
+      }
+    }
+
+    std::fprintf(stderr, "cxxmatrix: the level hysteresis (%s) needs to be a non-negative number.\n", level_hysteresis_text);
+    flag_error = true;
+  }
+
+  void set_max_bytes_per_frame(const char* max_bytes_text) {
+    if (std::isdigit(max_bytes_text[0])) {
+      this->max_bytes_per_frame = std::strtoul(max_bytes_text, nullptr, 10);
+      return;
+    }
+
+    std::fprintf(stderr, "cxxmatrix: the max bytes per frame (%s) needs to be a non-negative integer.\n", max_bytes_text);
+    flag_error = true;
+  }
+  void set_resync_rows(const char* resync_rows_text) {
+    if (std::isdigit(resync_rows_text[0])) {
+      this->resync_rows = std::min(std::atoi(resync_rows_text), 9999);
+      return;
+    }
+
+    std::fprintf(stderr, "cxxmatrix: the number of resync rows (%s) needs to be a non-negative integer.\n", resync_rows_text);
+    flag_error = true;
+  }
+  void set_link_bps(const char* link_bps_text) {
+    if (std::isdigit(link_bps_text[0])) {
+      double const value = std::atof(link_bps_text);
+      if (0.0 <= value) {
+        this->link_bps = value;
+        return;
+      }
+    }
+
+    std::fprintf(stderr, "cxxmatrix: the link bps (%s) needs to be a non-negative number.\n", link_bps_text);
+    flag_error = true;
+  }
+
 public:
   bool process(int argc, char** argv) {
     bool flag_literal = false;
@@ -2023,6 +4769,30 @@ public:
             flag_preserve_background = true;
           } else if (is_longopt("no-preserve-background")) {
             flag_preserve_background = false;
+          } else if (is_longopt("sync-update")) {
+            flag_sync_update = 1;
+          } else if (is_longopt("no-sync-update")) {
+            flag_sync_update = 0;
+          } else if (is_longopt("scroll-region")) {
+            flag_scroll_region = true;
+          } else if (is_longopt("no-scroll-region")) {
+            flag_scroll_region = false;
+          } else if (is_longopt("stable-glyphs")) {
+            flag_stable_glyphs = true;
+          } else if (is_longopt("no-stable-glyphs")) {
+            flag_stable_glyphs = false;
+          } else if (is_longopt("soft-font")) {
+            flag_soft_font = true;
+          } else if (is_longopt("no-soft-font")) {
+            flag_soft_font = false;
+          } else if (is_longopt("osc-palette")) {
+            flag_osc_palette = true;
+          } else if (is_longopt("no-osc-palette")) {
+            flag_osc_palette = false;
+          } else if (is_longopt("stats")) {
+            flag_stats = true;
+          } else if (is_longopt("self-test")) {
+            flag_self_test = true;
           } else if (is_longopt("message")) {
             push_message(get_longoptarg());
           } else if (is_longopt("scene")) {
@@ -2031,12 +4801,24 @@ public:
             set_color(get_longoptarg());
           } else if (is_longopt("colorspace")) {
             set_colorspace(get_longoptarg());
+          } else if (is_longopt("pixel")) {
+            set_pixel_protocol(get_longoptarg());
+          } else if (is_longopt("subcell")) {
+            set_subcell(get_longoptarg());
           } else if (is_longopt("frame-rate")) {
             set_frame_rate(get_longoptarg());
           } else if (is_longopt("error-rate")) {
             set_error_rate(get_longoptarg());
           } else if (is_longopt("rain-density")) {
             set_rain_density(get_longoptarg());
+          } else if (is_longopt("level-hysteresis")) {
+            set_level_hysteresis(get_longoptarg());
+          } else if (is_longopt("max-bytes-per-frame")) {
+            set_max_bytes_per_frame(get_longoptarg());
+          } else if (is_longopt("link-bps")) {
+            set_link_bps(get_longoptarg());
+          } else if (is_longopt("resync-rows")) {
+            set_resync_rows(get_longoptarg());
           } else {
             std::fprintf(stderr, "cxxmatrix: unknown long option (--%s)\n", arg);
             flag_error = true;
@@ -2097,6 +4879,7 @@ int main(int argc, char** argv) {
   } else {
     buff.s2banner_add_message("C++ Matrix");
   }
+  buff.set_osc_palette(args.flag_osc_palette); // initialize_color_table が参照する
   buff.initialize_color_table(args.color, args.colorspace);
   buff.set_frame_rate(args.frame_rate);
   buff.set_error_rate(args.error_rate);
@@ -2104,6 +4887,21 @@ int main(int argc, char** argv) {
   buff.set_twinkle_enabled(args.flag_twinkle_enabled);
   buff.set_preserve_background(args.flag_preserve_background);
   buff.set_rain_density(args.rain_density);
+  buff.set_level_hysteresis(args.level_hysteresis);
+  buff.set_stable_glyphs(args.flag_stable_glyphs);
+  buff.set_soft_font(args.flag_soft_font);
+  buff.set_max_bytes_per_frame(args.max_bytes_per_frame);
+  buff.set_link_bps(args.link_bps);
+  buff.set_resync_rows(args.resync_rows);
+  if (args.flag_sync_update >= 0)
+    buff.set_sync_update(args.flag_sync_update);
+  buff.set_scroll_region(args.flag_scroll_region);
+  buff.set_pixel_protocol(args.pixel_protocol);
+  buff.set_subcell(args.subcell);
+  buff.set_stats_enabled(args.flag_stats);
+  buff.set_colorspace_auto(args.flag_colorspace_auto);
+  if (args.flag_self_test)
+    return buff.self_test(args.color, args.scenes) ? 0 : 1;
 
   std::signal(SIGINT, trapint);
   term_init();
@@ -29,19 +29,24 @@ inline double randf() {
   static std::uniform_real_distribution<double> dist(0, 1.0);
   return dist(rand_engine());
 }
-inline char32_t rand_char() {
-  std::uint32_t r = util::rand() % 80;
-  if (r < 10)
-    return U'0' + r;
+// rand_char が返す文字の種類 (数字、半角カナ、記号)
+constexpr int rand_char_count = 10 + 46 + 9;
+inline char32_t rand_char_at(int index) {
+  if (index < 10)
+    return U'0' + index;
   else
-    r -= 10;
+    index -= 10;
 
-  if (r < 46)
-    return U'ｰ' + r;
+  if (index < 46)
+    return U'ｰ' + index;
   else
-    r -= 46;
+    index -= 46;
 
-  return U"<>*+.:=_|"[r % 9];
+  return U"<>*+.:=_|"[index];
+}
+inline char32_t rand_char() {
+  std::uint32_t const r = util::rand() % 80;
+  return rand_char_at(r < 56 ? r : 56 + (r - 56) % 9);
 }
 inline int mod(int value, int modulo) {
   value %= modulo;
@@ -49,6 +54,39 @@ inline int mod(int value, int modulo) {
   return value;
 }
 
+// 最下位から連続する 0 のビット数 (value != 0)
+inline int countr_zero(std::uint64_t value) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(value);
+#else
+  int count = 0;
+  for (; !(value & 1); value >>= 1) count++;
+  return count;
+#endif
+}
+
+// 最上位から連続する 0 のビット数 (value != 0)
+inline int countl_zero(std::uint64_t value) {
+#if defined(__GNUC__)
+  return __builtin_clzll(value);
+#else
+  int count = 0;
+  for (; !(value >> 63); value <<= 1) count++;
+  return count;
+#endif
+}
+
+// 1 のビット数
+inline int popcount(std::uint64_t value) {
+#if defined(__GNUC__)
+  return __builtin_popcountll(value);
+#else
+  int count = 0;
+  for (; value; value &= value - 1) count++;
+  return count;
+#endif
+}
+
 inline constexpr double interpolate(double value, double a, double b) {
   return a + (b - a) * value;
 }
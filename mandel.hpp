@@ -18,7 +18,20 @@ namespace cxxmatrix {
 
     bool prev_avail = false;
     std::vector<double> data_new;
+
+    // 1つの点の幅・高さ (セルの高さを 1 とする)。既定はセル毎に1点。
+    double xunit = 0.5, yunit = 1.0;
+    int resample_count = 5; // 前フレームから補間する時の各方向の標本数
   public:
+    void set_unit(double xunit, double yunit, int resample_count) {
+      this->resample_count = resample_count;
+      if (xunit == this->xunit && yunit == this->yunit) return;
+      this->xunit = xunit;
+      this->yunit = yunit;
+      this->prev_avail = false;
+      std::fill(data.begin(), data.end(), -1.0);
+    }
+
     void resize(int cols, int rows) {
       if (cols == this->cols && rows == this->rows) return;
       this->cols = cols;
@@ -83,11 +96,11 @@ namespace cxxmatrix {
       double const dtheta = theta - this->theta;
       double const dscale = scale / this->scale;
       int const ox = cols / 2, oy = rows / 2;
-      double const u_x = +dscale * std::cos(dtheta) * 0.5 * 2.0;
-      double const u_y = -dscale * std::sin(dtheta)       * 2.0;
-      double const v_x = +dscale * std::sin(dtheta) * 0.5;
+      double const u_x = +dscale * std::cos(dtheta);
+      double const u_y = -dscale * std::sin(dtheta) * (yunit / xunit);
+      double const v_x = +dscale * std::sin(dtheta) * (xunit / yunit);
       double const v_y = +dscale * std::cos(dtheta);
-      int const Na = 5, Nb = 5;
+      int const Na = resample_count, Nb = resample_count;
       for (int y = 0; y < rows; y++) {
         for (int x = 0; x < cols; x++) {
           double const u = ox + (u_x * (x - ox) + u_y * (oy - y));
@@ -165,10 +178,10 @@ namespace cxxmatrix {
 
       this->theta = theta;
       this->scale = scale;
-      this->u_x = +scale * std::cos(theta) * 0.5;
-      this->u_y = -scale * std::sin(theta);
-      this->v_x = +scale * std::sin(theta) * 0.5;
-      this->v_y = +scale * std::cos(theta);
+      this->u_x = +scale * std::cos(theta) * xunit;
+      this->u_y = -scale * std::sin(theta) * yunit;
+      this->v_x = +scale * std::sin(theta) * xunit;
+      this->v_y = +scale * std::cos(theta) * yunit;
 
       positions.resize(cols * rows);
       std::iota(positions.begin(), positions.end(), 0);
@@ -0,0 +1,436 @@
+#ifndef cxxmatrix_pixel_hpp
+#define cxxmatrix_pixel_hpp
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "cxxmatrix.hpp"
+
+namespace cxxmatrix {
+
+  enum pixel_protocol_t {
+    pixel_none  = 0,
+    pixel_sixel = 1, // DCS q ... ST
+    pixel_kitty = 2, // APC G ... ST (kitty graphics protocol)
+  };
+
+  // パレット番号で表した画像
+  struct pixel_image_t {
+    int width = 0, height = 0;
+    std::vector<byte> data;
+
+    void resize(int width, int height) {
+      this->width = width;
+      this->height = height;
+      data.assign((std::size_t) width * height, 0);
+    }
+    byte* row(int y) { return &data[(std::size_t) y * width]; }
+    byte const* row(int y) const { return &data[(std::size_t) y * width]; }
+  };
+
+  // Output は size(), put(char), write(const char*, size_t), write(文字列リテラル),
+  // put_dec(unsigned) を持つ出力先 (output_buffer またはその代わりになる物)。
+
+  // Sixel の符号化。6 行 (band) 毎に、その band に現れる色だけについて
+  // 各列 6 bit の模様を一度の走査で作り、繰り返しを "!n" に纏めて送る。
+  class sixel_encoder_t {
+    std::vector<byte> bits;        // [色][列] の 6 bit の模様
+    std::vector<byte> band_colors; // この band に現れる色 (現れた順)
+    std::vector<bool> band_used;
+    std::vector<bool> defined;     // この画像で既に色を定義した
+
+    template<typename Output>
+    static void put_repeat(Output& out, int count, char ch) {
+      if (count >= 4) {
+        out.put('!');
+        out.put_dec(count);
+        out.put(ch);
+      } else {
+        while (count--) out.put(ch);
+      }
+    }
+
+    template<typename Output>
+    static void put_color(Output& out, int index, std::uint32_t color) {
+      out.put('#');
+      out.put_dec(index);
+      out.write(";2;");
+      out.put_dec(percent(0xFF & color));
+      out.put(';');
+      out.put_dec(percent(0xFF & color >> 8));
+      out.put(';');
+      out.put_dec(percent(0xFF & color >> 16));
+    }
+
+  public:
+    // 色の値は 0-100 の百分率で指定する
+    static unsigned percent(unsigned value) { return (value * 100 + 127) / 255; }
+
+    // image の (x0, y0) から width x height の範囲を、現在のカーソル位置に描く。
+    // P2 = 1 (0 のビットの画素は書き換えない) なので、最後の band の画像外の部分で隣を壊さない。
+    template<typename Output>
+    void encode(Output& out, pixel_image_t const& image, int x0, int y0, int width, int height,
+      std::vector<std::uint32_t> const& palette)
+    {
+      std::size_t const ncolor = palette.size();
+      bits.resize(ncolor * width);
+      band_used.assign(ncolor, false);
+      defined.assign(ncolor, false);
+
+      out.write("\x1bP0;1;0q\"1;1;");
+      out.put_dec(width);
+      out.put(';');
+      out.put_dec(height);
+
+      for (int y = 0; y < height; y += 6) {
+        band_colors.clear();
+        int const nline = std::min(6, height - y);
+        for (int r = 0; r < nline; r++) {
+          byte const* const line = image.row(y0 + y + r) + x0;
+          for (int x = 0; x < width; x++) {
+            byte const c = line[x];
+            byte* const pattern = &bits[(std::size_t) c * width];
+            if (!band_used[c]) {
+              band_used[c] = true;
+              band_colors.push_back(c);
+              std::fill_n(pattern, width, 0);
+            }
+            pattern[x] |= 1 << r;
+          }
+        }
+
+        if (y) out.put('-');
+        bool first = true;
+        for (byte const c: band_colors) {
+          band_used[c] = false;
+          if (!first) out.put('$');
+          first = false;
+          if (!defined[c]) {
+            defined[c] = true;
+            put_color(out, c, palette[c]);
+          } else {
+            out.put('#');
+            out.put_dec(c);
+          }
+
+          // 末尾の空の列は送らない
+          byte const* const pattern = &bits[(std::size_t) c * width];
+          int end = width;
+          while (end > 0 && !pattern[end - 1]) end--;
+          for (int x = 0; x < end; ) {
+            byte const value = pattern[x];
+            int x2 = x + 1;
+            while (x2 < end && pattern[x2] == value) x2++;
+            put_repeat(out, x2 - x, (char) (63 + value));
+            x = x2;
+          }
+        }
+      }
+
+      out.write("\x1b\\");
+    }
+  };
+
+  // zlib (RFC 1950/1951) の簡単な符号化。固定 Huffman の1ブロックで、一致は
+  // 直前の画素 (distance = pixel) と1つ上の行 (distance = stride) だけを探す。
+  class zlib_encoder_t {
+    std::vector<byte>* dst = nullptr;
+    std::uint32_t bit_buffer = 0;
+    int bit_count = 0;
+
+    void put_bits(std::uint32_t value, int count) {
+      bit_buffer |= value << bit_count;
+      bit_count += count;
+      while (bit_count >= 8) {
+        dst->push_back(0xFF & bit_buffer);
+        bit_buffer >>= 8;
+        bit_count -= 8;
+      }
+    }
+    // Huffman 符号は上位ビットから詰める
+    void put_code(std::uint32_t code, int count) {
+      std::uint32_t reversed = 0;
+      for (int i = 0; i < count; i++) reversed |= (code >> i & 1) << (count - 1 - i);
+      put_bits(reversed, count);
+    }
+    void put_symbol(int symbol) {
+      if (symbol < 144)
+        put_code(0x30 + symbol, 8);
+      else if (symbol < 256)
+        put_code(0x190 + symbol - 144, 9);
+      else if (symbol < 280)
+        put_code(symbol - 256, 7);
+      else
+        put_code(0xC0 + symbol - 280, 8);
+    }
+    void put_match(int length, int distance) {
+      static constexpr int length_base[] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+      static constexpr int length_extra[] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+      int code = 28;
+      while (length_base[code] > length) code--;
+      put_symbol(257 + code);
+      put_bits(length - length_base[code], length_extra[code]);
+
+      // distance の符号: 0-3 はそのまま、以降は2つ毎に追加ビットが1つ増える
+      int const d = distance - 1;
+      int dcode, extra;
+      if (d < 4) {
+        dcode = d;
+        extra = 0;
+      } else {
+        extra = 63 - util::countl_zero(d) - 1; // floor(log2(d)) - 1
+        dcode = 2 * (extra + 1) + (d >> extra & 1);
+      }
+      put_code(dcode, 5);
+      put_bits(d & ((1u << extra) - 1), extra);
+    }
+
+  public:
+    void encode(std::vector<byte>& dst, std::vector<byte> const& src, std::size_t pixel, std::size_t stride) {
+      constexpr std::size_t max_distance = 32768, max_length = 258;
+      this->dst = &dst;
+      bit_buffer = 0;
+      bit_count = 0;
+      dst.clear();
+      dst.push_back(0x78);
+      dst.push_back(0x01);
+      put_bits(1, 1); // BFINAL
+      put_bits(1, 2); // BTYPE = 01 (固定 Huffman)
+
+      std::size_t const size = src.size();
+      auto match_length = [&] (std::size_t i, std::size_t distance) -> std::size_t {
+        if (distance > i || distance > max_distance) return 0;
+        std::size_t const end = std::min(size, i + max_length);
+        std::size_t j = i;
+        while (j < end && src[j] == src[j - distance]) j++;
+        return j - i;
+      };
+      for (std::size_t i = 0; i < size; ) {
+        std::size_t length = match_length(i, pixel), distance = pixel;
+        if (length < max_length) {
+          if (std::size_t const up = match_length(i, stride); up > length) {
+            length = up;
+            distance = stride;
+          }
+        }
+        if (length >= 3) {
+          put_match(length, distance);
+          i += length;
+        } else {
+          put_symbol(src[i++]);
+        }
+      }
+      put_symbol(256);
+      if (bit_count) put_bits(0, 8 - bit_count);
+
+      // Adler-32
+      std::uint32_t a = 1, b = 0;
+      for (std::size_t i = 0; i < size; ) {
+        std::size_t const end = std::min(size, i + 5552);
+        for (; i < end; i++) {
+          a += src[i];
+          b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+      }
+      std::uint32_t const adler = b << 16 | a;
+      for (int shift = 24; shift >= 0; shift -= 8)
+        dst.push_back(0xFF & adler >> shift);
+    }
+  };
+
+  // kitty graphics protocol の符号化。パレットを RGB (f=24) に展開し、zlib で圧縮 (o=z) して
+  // base64 で送る。
+  // 同じ画像番号で送り直すと置き換わるので、タイル毎に番号を固定して使い回す。
+  class kitty_encoder_t {
+    static constexpr std::size_t chunk_size = 4096; // 1つの APC で送る base64 の最大長
+    std::vector<byte> rgb;
+    std::vector<byte> compressed;
+    std::vector<char> base64;
+    zlib_encoder_t zlib;
+
+    static void encode_base64(std::vector<char>& dst, std::vector<byte> const& src) {
+      static constexpr char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+      dst.resize((src.size() + 2) / 3 * 4);
+      char* p = dst.data();
+      std::size_t i = 0;
+      for (; i + 3 <= src.size(); i += 3) {
+        std::uint32_t const v = src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+        *p++ = table[v >> 18 & 63];
+        *p++ = table[v >> 12 & 63];
+        *p++ = table[v >> 6 & 63];
+        *p++ = table[v & 63];
+      }
+      if (std::size_t const rest = src.size() - i) {
+        std::uint32_t const v = src[i] << 16 | (rest > 1 ? src[i + 1] << 8 : 0);
+        *p++ = table[v >> 18 & 63];
+        *p++ = table[v >> 12 & 63];
+        *p++ = rest > 1 ? table[v >> 6 & 63] : '=';
+        *p++ = '=';
+      }
+    }
+
+  public:
+    // image の (x0, y0) から width x height の範囲を、画像番号 id として現在のカーソル位置に
+    // cols x rows セルの大きさで置く (C=1: カーソルは動かさない, q=2: 応答は返さない)。
+    template<typename Output>
+    void encode(Output& out, pixel_image_t const& image, int x0, int y0, int width, int height,
+      std::vector<std::uint32_t> const& palette, unsigned id, int cols, int rows)
+    {
+      rgb.resize((std::size_t) width * height * 3);
+      byte* q = rgb.data();
+      for (int y = 0; y < height; y++) {
+        byte const* const line = image.row(y0 + y) + x0;
+        for (int x = 0; x < width; x++) {
+          std::uint32_t const color = palette[line[x]];
+          *q++ = 0xFF & color;
+          *q++ = 0xFF & color >> 8;
+          *q++ = 0xFF & color >> 16;
+        }
+      }
+      zlib.encode(compressed, rgb, 3, (std::size_t) width * 3);
+      encode_base64(base64, compressed);
+
+      for (std::size_t i = 0; i < base64.size(); i += chunk_size) {
+        std::size_t const n = std::min(chunk_size, base64.size() - i);
+        bool const more = i + n < base64.size();
+        out.write("\x1b_G");
+        if (i == 0) {
+          out.write("a=T,f=24,s=");
+          out.put_dec(width);
+          out.write(",v=");
+          out.put_dec(height);
+          out.write(",i=");
+          out.put_dec(id);
+          out.write(",p=1,c=");
+          out.put_dec(cols);
+          out.write(",r=");
+          out.put_dec(rows);
+          out.write(",o=z,C=1,q=2,");
+        }
+        if (more) out.write("m=1;"); else out.write("m=0;");
+        out.write(&base64[i], n);
+        out.write("\x1b\\");
+      }
+    }
+  };
+
+  // セルの範囲に重ねる画像。セル単位のタイルに分けて、端末に表示されている内容
+  // (shown) から変化したタイルだけを送る。
+  class pixel_canvas_t {
+    pixel_protocol_t protocol = pixel_none;
+    int cell_width = 10, cell_height = 20; // 1セルの画素数
+    int tile_cols = 16, tile_rows = 4;     // 1タイルのセル数
+    int cols = 0, rows = 0;
+    int ntile_x = 0, ntile_y = 0;
+    pixel_image_t image; // 次に表示する内容
+    pixel_image_t shown; // 端末に表示されている内容
+    std::vector<bool> tile_shown; // shown が端末の内容と一致しているタイル
+    sixel_encoder_t sixel;
+    kitty_encoder_t kitty;
+
+  public:
+    std::vector<std::uint32_t> palette; // 色番号 → 0xBBGGRR
+
+    void set_protocol(pixel_protocol_t value) { protocol = value; }
+    pixel_protocol_t get_protocol() const { return protocol; }
+    void set_tile_size(int cols, int rows) {
+      tile_cols = std::max(cols, 1);
+      tile_rows = std::max(rows, 1);
+      this->cols = -1; // 次の resize でタイルを分け直す
+    }
+
+    int get_cell_width() const { return cell_width; }
+    int get_cell_height() const { return cell_height; }
+    int get_cols() const { return cols; }
+    int get_rows() const { return rows; }
+    int width() const { return image.width; }
+    int height() const { return image.height; }
+    byte* row(int y) { return image.row(y); }
+    // 端末に表示されている筈の内容 (is_shown が偽のタイルは未だ送っていない)
+    byte const* shown_row(int y) const { return shown.row(y); }
+    int tile_width() const { return tile_cols * cell_width; }
+    bool is_shown(int x, int y) const {
+      return tile_shown[(std::size_t) (y / cell_height / tile_rows) * ntile_x + x / tile_width()];
+    }
+
+    // cols x rows セルの範囲を覆う。大きさが変わったら全てのタイルを送り直す。
+    void resize(int cols, int rows, int cell_width, int cell_height) {
+      cols = std::max(cols, 0);
+      rows = std::max(rows, 0);
+      if (cols == this->cols && rows == this->rows &&
+        cell_width == this->cell_width && cell_height == this->cell_height) return;
+      this->cols = cols;
+      this->rows = rows;
+      this->cell_width = cell_width;
+      this->cell_height = cell_height;
+      image.resize(cols * cell_width, rows * cell_height);
+      shown.resize(cols * cell_width, rows * cell_height);
+      ntile_x = (cols + tile_cols - 1) / tile_cols;
+      ntile_y = (rows + tile_rows - 1) / tile_rows;
+      invalidate();
+    }
+    // 端末の内容が上書きされた
+    void invalidate() {
+      tile_shown.assign((std::size_t) ntile_x * ntile_y, false);
+    }
+
+  private:
+    bool tile_changed(int x0, int y0, int width, int height) const {
+      for (int y = y0; y < y0 + height; y++)
+        if (std::memcmp(image.row(y) + x0, shown.row(y) + x0, width) != 0) return true;
+      return false;
+    }
+
+  public:
+    // 変化したタイルを送る。出力が budget を超えたら残りのタイルは次の呼び出しに持ち越す
+    // (budget = 0 は無制限)。goto_cell(x, y) はカーソルをセル (x, y) に移動する。
+    // 送ったタイルの数を返す。
+    template<typename Output, typename GotoCell>
+    int flush(Output& out, std::size_t budget, GotoCell&& goto_cell) {
+      if (protocol == pixel_none) return 0;
+      std::size_t const mark = out.size();
+      int count = 0;
+      for (int ty = 0; ty < ntile_y; ty++) {
+        for (int tx = 0; tx < ntile_x; tx++) {
+          int const cx = tx * tile_cols, cy = ty * tile_rows;
+          int const ncol = std::min(tile_cols, cols - cx);
+          int const nrow = std::min(tile_rows, rows - cy);
+          int const x0 = cx * cell_width, y0 = cy * cell_height;
+          int const width = ncol * cell_width, height = nrow * cell_height;
+          std::size_t const index = (std::size_t) ty * ntile_x + tx;
+          if (tile_shown[index] && !tile_changed(x0, y0, width, height)) continue;
+          if (budget && count && out.size() - mark >= budget) return count;
+
+          goto_cell(cx, cy);
+          if (protocol == pixel_sixel)
+            sixel.encode(out, image, x0, y0, width, height, palette);
+          else
+            kitty.encode(out, image, x0, y0, width, height, palette, index + 1, ncol, nrow);
+          for (int y = y0; y < y0 + height; y++)
+            std::memcpy(shown.row(y) + x0, image.row(y) + x0, width);
+          tile_shown[index] = true;
+          count++;
+        }
+      }
+      return count;
+    }
+
+    // 表示した画像を消す (kitty の画像は文字で上書きされないので明示的に消す)
+    template<typename Output>
+    void clear(Output& out) {
+      if (protocol == pixel_kitty)
+        out.write("\x1b_Ga=d,d=A,q=2\x1b\\");
+      invalidate();
+    }
+  };
+
+}
+
+#endif
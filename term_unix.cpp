@@ -1,9 +1,15 @@
 #include <cstddef>
 #include <csignal>
+#include <cerrno>
+#include <chrono>
+#include <thread>
 #include <unistd.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 #include "cxxmatrix.hpp"
 
 namespace cxxmatrix {
@@ -24,6 +30,18 @@ namespace cxxmatrix {
     return term_winsize_from_env(cols, rows);
   }
 
+  // 1セルの画素数 (端末が TIOCGWINSZ で画素数を報告している時)
+  bool term_get_cell_size(int& width, int& height) {
+    struct winsize ws;
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, (char*) &ws) == 0 &&
+      ws.ws_col > 0 && ws.ws_row > 0 && ws.ws_xpixel >= ws.ws_col && ws.ws_ypixel >= ws.ws_row) {
+      width = ws.ws_xpixel / ws.ws_col;
+      height = ws.ws_ypixel / ws.ws_row;
+      return true;
+    }
+    return false;
+  }
+
   static struct termios term_termios_save;
 
   void term_enter() {
@@ -40,7 +58,10 @@ namespace cxxmatrix {
   }
 
   void term_leave() {
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &term_termios_save);
+    // TCSAFLUSH は出力が送られるまで待つので、端末が止まっていると戻らない。
+    // 出力の変換は write の時に済んでいるので、入力だけ捨ててすぐに戻す。
+    tcflush(STDIN_FILENO, TCIFLUSH);
+    tcsetattr(STDIN_FILENO, TCSANOW, &term_termios_save);
   }
 
   std::ptrdiff_t term_read(byte* buffer, std::size_t size) {
@@ -52,4 +73,71 @@ namespace cxxmatrix {
       return (ssize_t) read(STDIN_FILENO, buffer, (ssize_t) size);
     return 0;
   }
+
+  bool term_write(const char* data, std::size_t size) {
+    while (size) {
+      ssize_t const nwrite = write(STDOUT_FILENO, data, size);
+      if (nwrite < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          struct pollfd pollfd;
+          pollfd.fd = STDOUT_FILENO;
+          pollfd.events = POLLOUT;
+          poll(&pollfd, 1, -1);
+          continue;
+        }
+        return false;
+      }
+      data += nwrite;
+      size -= nwrite;
+    }
+    return true;
+  }
+
+  // 端末の出力キューに残っていて未だ送られていないバイト数 (不明な時は -1)
+  std::ptrdiff_t term_output_queue() {
+#ifdef TIOCOUTQ
+    int value = 0;
+    if (ioctl(STDOUT_FILENO, TIOCOUTQ, &value) == 0)
+      return value;
+#endif
+    return -1;
+  }
+
+  // 呼び出したスレッドでシグナルを受け取らない様にする (mask = true)・元に戻す (mask = false)。
+  // 作成されたスレッドは設定を引き継ぐので、シグナルを主スレッドだけで処理する為に使う。
+  void term_mask_signals(bool mask) {
+    static sigset_t save;
+    if (mask) {
+      sigset_t all;
+      sigfillset(&all);
+      pthread_sigmask(SIG_BLOCK, &all, &save);
+    } else {
+      pthread_sigmask(SIG_SETMASK, &save, nullptr);
+    }
+  }
+
+  // フレームの予定時刻に使う単調増加の時計。clock_nanosleep があれば絶対時刻まで眠る。
+#if defined(_POSIX_TIMERS) && _POSIX_TIMERS > 0 && defined(CLOCK_MONOTONIC)
+  std::chrono::nanoseconds term_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+  }
+  void term_sleep_until(std::chrono::nanoseconds time) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) std::chrono::duration_cast<std::chrono::seconds>(time).count();
+    ts.tv_nsec = (long) (time % std::chrono::seconds(1)).count();
+    // シグナルで起こされても予定時刻まで眠る (シグナルはフレームの境界で処理する)
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR);
+  }
+#else
+  std::chrono::nanoseconds term_clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch());
+  }
+  void term_sleep_until(std::chrono::nanoseconds time) {
+    std::chrono::nanoseconds const now = term_clock();
+    if (time > now) std::this_thread::sleep_for(time - now);
+  }
+#endif
 }
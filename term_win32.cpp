@@ -5,7 +5,11 @@
 #include <sstream>
 #include <string>
 #include <algorithm>
+#include <chrono>
+#include <thread>
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
 #include "cxxmatrix.hpp"
 
 namespace cxxmatrix {
@@ -81,7 +85,8 @@ namespace cxxmatrix {
       if (GetConsoleMode(hOut, &conpty_output_mode_save) == 0) {
         print_error_message("GetConsoleMode (stdout)");
       } else {
-        if (SetConsoleMode(hOut, conpty_output_mode_save | ENABLE_VIRTUAL_TERMINAL_PROCESSING) == 0)
+        // LF で列を変えない (cxxmatrix.cpp の vmove_lf は LF で真下に移動する)
+        if (SetConsoleMode(hOut, conpty_output_mode_save | ENABLE_VIRTUAL_TERMINAL_PROCESSING | DISABLE_NEWLINE_AUTO_RETURN) == 0)
           print_error_message("SetConsoleMode (stdout)");
       }
     }
@@ -286,6 +291,9 @@ namespace cxxmatrix {
   }
 
   void term_init() {
+    // テキストモードでは LF が CRLF に変換されるのでバイナリモードで出力する
+    _setmode(_fileno(stdout), _O_BINARY);
+
     if (HANDLE hIn = GetStdHandle(STD_INPUT_HANDLE); hIn == INVALID_HANDLE_VALUE) {
       print_error_message("GetStdHandle (stdin)");
     } else {
@@ -308,6 +316,8 @@ namespace cxxmatrix {
     rows = default_rows;
     return true;
   }
+  // セルの画素数は分からないので端末への問い合わせ (XTWINOPS) の応答に任せる
+  bool term_get_cell_size(int&, int&) { return false; }
 
   void term_enter() {
     if (conpty_enabled) conpty_enter();
@@ -325,4 +335,23 @@ namespace cxxmatrix {
       return stty_read(buffer, size);
     return 0;
   }
+
+  bool term_write(const char* data, std::size_t size) {
+    bool const result = std::fwrite(data, 1, size, stdout) == size;
+    std::fflush(stdout);
+    return result;
+  }
+
+  void term_mask_signals(bool) {}
+
+  // コンソールの出力キューの大きさは取得できない
+  std::ptrdiff_t term_output_queue() { return -1; }
+
+  std::chrono::nanoseconds term_clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch());
+  }
+  void term_sleep_until(std::chrono::nanoseconds time) {
+    std::chrono::nanoseconds const now = term_clock();
+    if (time > now) std::this_thread::sleep_for(time - now);
+  }
 }
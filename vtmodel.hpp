@@ -0,0 +1,1038 @@
+#ifndef cxxmatrix_vtmodel_hpp
+#define cxxmatrix_vtmodel_hpp
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cxxmatrix.hpp"
+
+namespace cxxmatrix {
+
+  // 端末の画面のモデル (--self-test 用)。cxxmatrix が出力する制御機能を xterm と同様に
+  // 解釈して、各セルの文字・前景色・背景色・太字を記録する。色は SGR の引数の表現毎に
+  // 番号を割り当てて区別する (0 は既定色)。解釈できない制御機能があれば error に記録する。
+  struct vt_model_t {
+    struct vt_cell_t {
+      char32_t c = U' ';
+      int fg = 0;
+      int bg = 0;
+      bool bold = false;
+    };
+
+  private:
+    int cols = 0, rows = 0;
+    std::vector<vt_cell_t> cells;
+    int x = 0, y = 0;
+    bool wrap_pending = false;
+    bool decawm = true;
+    bool declrmm = false;
+    int top = 0, bottom = 0;  // スクロール領域 [top, bottom]
+    int left = 0, right = 0;  // 左右の余白 [left, right]
+    int fg = 0, bg = 0;
+    bool bold = false;
+    char32_t last_char = U' ';
+
+    // 文字集合 (SCS で G0/G1 に指定し、SI/SO で GL に呼び出す)。
+    // DECDLD で登録された文字は soft_char_base + 文字コードとしてセルに記録する。
+    std::string charsets[2] {"B", "B"};
+    int gl = 0;
+    std::string soft_dscs; // DECDLD で登録した文字集合の名前 (Dscs)
+    std::vector<std::uint16_t> soft_glyphs[0x60]; // 文字コード 0x20-0x7F の各行のビット列
+
+    std::vector<std::string> color_names {"default"};
+    std::unordered_map<std::string, int> color_table {{"default", 0}};
+    std::unordered_map<std::string, std::string> palette; // OSC 4 で設定した色 ("5:N" → "2:R:G:B")
+
+    // 画像 (sixel と kitty graphics protocol)。画素は 0xBBGGRR で、画像のない画素は no_pixel。
+    // kitty の画像は番号毎に保持して文字や sixel の上に重ねる (同じ番号で送ると置き換わる)。
+    struct kitty_image_t {
+      unsigned id;
+      int x, y, width, height; // 画素単位の位置と大きさ
+      std::vector<std::uint32_t> data;
+    };
+    int cell_width = 10, cell_height = 20;
+    std::vector<std::uint32_t> sixel_plane;
+    std::vector<std::uint32_t> kitty_plane;
+    std::vector<kitty_image_t> kitty_images;
+    std::unordered_map<int, std::uint32_t> sixel_registers;
+    std::string kitty_keys;    // 分割された kitty の転送の最初の部分の制御データ
+    std::string kitty_payload; // 分割された kitty の転送の base64 の内容
+
+    std::string error_message;
+
+  public:
+    static constexpr std::uint32_t no_pixel = 0xFFFFFFFF;
+
+    void set_cell_size(int width, int height) {
+      cell_width = width;
+      cell_height = height;
+    }
+    void resize(int cols, int rows) {
+      this->cols = cols;
+      this->rows = rows;
+      cells.assign(cols * rows, vt_cell_t());
+      x = y = 0;
+      wrap_pending = false;
+      decawm = true;
+      declrmm = false;
+      top = left = 0;
+      bottom = rows - 1;
+      right = cols - 1;
+      fg = bg = 0;
+      bold = false;
+      palette.clear();
+      charsets[0] = charsets[1] = "B";
+      gl = 0;
+      soft_dscs.clear();
+      for (auto& glyph: soft_glyphs) glyph.clear();
+      sixel_plane.assign((std::size_t) cols * cell_width * rows * cell_height, no_pixel);
+      kitty_plane.assign(sixel_plane.size(), no_pixel);
+      kitty_images.clear();
+      sixel_registers.clear();
+      kitty_keys.clear();
+      kitty_payload.clear();
+      state = state_ground;
+      error_message.clear();
+    }
+    static constexpr char32_t soft_char_base = 0xF0000;
+    // DECDLD で登録された文字コード code の画素 (各行のビット列、最下位ビットが左端)
+    std::vector<std::uint16_t> const& soft_glyph(byte code) const { return soft_glyphs[(byte) (code - 0x20) % 0x60]; }
+    vt_cell_t const& cell(int x, int y) const { return cells[y * cols + x]; }
+    // 画素 (x, y) に表示されている画像の色 (画像がなければ no_pixel)
+    std::uint32_t pixel(int x, int y) const {
+      std::size_t const index = (std::size_t) y * cols * cell_width + x;
+      return kitty_plane[index] != no_pixel ? kitty_plane[index] : sixel_plane[index];
+    }
+    // sixel で百分率 (0-100) で指定された色を端末が表示する色
+    static std::uint32_t sixel_color(int r, int g, int b) {
+      auto const value = [] (int percent) { return (std::uint32_t) (std::clamp(percent, 0, 100) * 255 + 50) / 100; };
+      return value(b) << 16 | value(g) << 8 | value(r);
+    }
+    std::string const& color_name(int color) const { return color_names[color]; }
+    std::string const& error() const { return error_message; }
+
+    // SGR を一つ解釈した時の前景色 (is_fg) または背景色の番号
+    int sgr_color(std::string const& seq, bool is_fg) {
+      int const save_fg = fg, save_bg = bg;
+      bool const save_bold = bold;
+      fg = bg = 0;
+      feed(seq.data(), seq.size());
+      int const result = is_fg ? fg : bg;
+      fg = save_fg;
+      bg = save_bg;
+      bold = save_bold;
+      return result;
+    }
+
+  private:
+    void fail(std::string const& message) {
+      if (error_message.empty()) error_message = message;
+    }
+    int color(std::string const& spec) {
+      auto const entry = palette.find(spec);
+      std::string const& name = entry != palette.end() ? entry->second : spec;
+      auto const it = color_table.find(name);
+      if (it != color_table.end()) return it->second;
+      int const index = color_names.size();
+      color_names.push_back(name);
+      color_table.emplace(name, index);
+      return index;
+    }
+
+    vt_cell_t& at(int x, int y) { return cells[y * cols + x]; }
+    vt_cell_t blank() const {
+      vt_cell_t cell;
+      cell.bg = bg;
+      return cell;
+    }
+
+    void put_char(char32_t c) {
+      if (wrap_pending && decawm) {
+        x = left;
+        line_feed();
+      }
+      wrap_pending = false;
+      vt_cell_t& cell = at(x, y);
+      cell.c = c;
+      cell.fg = fg;
+      cell.bg = bg;
+      cell.bold = bold;
+      last_char = c;
+      if (x == cols - 1)
+        wrap_pending = true;
+      else
+        x++;
+    }
+    void line_feed() {
+      wrap_pending = false;
+      if (y == bottom)
+        scroll_up(1, top, bottom);
+      else if (y < rows - 1)
+        y++;
+    }
+
+    void scroll_up(int count, int y1, int y2) {
+      count = std::min(count, y2 - y1 + 1);
+      for (int yy = y1; yy <= y2; yy++)
+        for (int xx = left; xx <= right; xx++)
+          at(xx, yy) = yy + count <= y2 ? at(xx, yy + count) : blank();
+    }
+    void scroll_down(int count, int y1, int y2) {
+      count = std::min(count, y2 - y1 + 1);
+      for (int yy = y2; yy >= y1; yy--)
+        for (int xx = left; xx <= right; xx++)
+          at(xx, yy) = yy - count >= y1 ? at(xx, yy - count) : blank();
+    }
+    void shift_left(int count, int x1, int x2, int y1, int y2) {
+      count = std::min(count, x2 - x1 + 1);
+      for (int yy = y1; yy <= y2; yy++)
+        for (int xx = x1; xx <= x2; xx++)
+          at(xx, yy) = xx + count <= x2 ? at(xx + count, yy) : blank();
+    }
+    void shift_right(int count, int x1, int x2, int y1, int y2) {
+      count = std::min(count, x2 - x1 + 1);
+      for (int yy = y1; yy <= y2; yy++)
+        for (int xx = x2; xx >= x1; xx--)
+          at(xx, yy) = xx - count >= x1 ? at(xx - count, yy) : blank();
+    }
+
+  private:
+    std::vector<int> params;
+    std::vector<std::string> subparams; // 各引数の文字列 (':' で区切った部分引数を含む)
+    std::string intermediate;
+    char private_marker = 0;
+
+    int param(std::size_t index, int default_value) const {
+      if (index >= params.size() || params[index] <= 0) return default_value;
+      return params[index];
+    }
+
+    void sgr() {
+      if (params.empty()) params.push_back(0);
+      for (std::size_t i = 0; i < params.size(); i++) {
+        int const p = params[i];
+        if (subparams[i].find(':') != std::string::npos) {
+          // ISO 8613-6 の形式 (38:2::R:G:B など)
+          std::string const& spec = subparams[i];
+          std::string const name = spec.substr(spec.find(':') + 1);
+          if (p == 38)
+            fg = color(name);
+          else if (p == 48)
+            bg = color(name);
+          else
+            fail("SGR " + spec);
+          continue;
+        }
+
+        if (p == 0) {
+          fg = bg = 0;
+          bold = false;
+        } else if (p == 1) {
+          bold = true;
+        } else if (p == 22) {
+          bold = false;
+        } else if (30 <= p && p <= 37) {
+          fg = color("5:" + std::to_string(p - 30));
+        } else if (40 <= p && p <= 47) {
+          bg = color("5:" + std::to_string(p - 40));
+        } else if (90 <= p && p <= 97) {
+          fg = color("5:" + std::to_string(p - 90 + 8));
+        } else if (100 <= p && p <= 107) {
+          bg = color("5:" + std::to_string(p - 100 + 8));
+        } else if (p == 39) {
+          fg = 0;
+        } else if (p == 49) {
+          bg = 0;
+        } else if ((p == 38 || p == 48) && i + 1 < params.size()) {
+          // xterm の形式 (38;5;N, 38;2;R;G;B)
+          std::size_t const count = params[i + 1] == 5 ? 1 : params[i + 1] == 2 ? 3 : 0;
+          if (count == 0 || i + 1 + count >= params.size()) {
+            fail("SGR " + std::to_string(p));
+            return;
+          }
+          std::string name = std::to_string(params[i + 1]);
+          for (std::size_t k = 0; k < count; k++)
+            name += ":" + std::to_string(params[i + 2 + k]);
+          (p == 38 ? fg : bg) = color(name);
+          i += 1 + count;
+        } else {
+          fail("SGR " + std::to_string(p));
+        }
+      }
+    }
+
+    void set_mode(bool value) {
+      if (private_marker != '?') {
+        fail("SM/RM");
+        return;
+      }
+      for (int mode: params) {
+        switch (mode) {
+        case 7: decawm = value; break;
+        case 25: break;
+        case 69:
+          declrmm = value;
+          left = 0;
+          right = cols - 1;
+          break;
+        case 1049:
+          if (value) cells.assign(cols * rows, vt_cell_t());
+          break;
+        case 2026: break;
+        default:
+          fail("DECSET " + std::to_string(mode));
+          break;
+        }
+      }
+    }
+
+    void dispatch_csi(char final) {
+      if (!intermediate.empty()) {
+        int const count = param(0, 1);
+        if (intermediate == " " && final == '@') {
+          shift_left(count, left, right, top, bottom); // SL
+        } else if (intermediate == " " && final == 'A') {
+          shift_right(count, left, right, top, bottom); // SR
+        } else if (intermediate == "$" && final == 'p') {
+          // DECRQM
+        } else {
+          fail(std::string("CSI ") + intermediate + final);
+        }
+        return;
+      }
+      if (private_marker && final != 'h' && final != 'l') {
+        // DA2, XTVERSION などの問い合わせ
+        if (final != 'c' && final != 'q') fail(std::string("CSI ") + private_marker + final);
+        return;
+      }
+
+      int const count = param(0, 1);
+      switch (final) {
+      case 'h': set_mode(true); return;
+      case 'l': set_mode(false); return;
+      case 'm': sgr(); return;
+      case 'c': // DA1
+      case 'n': // DSR
+      case 't': // XTWINOPS
+        return;
+      }
+
+      wrap_pending = false;
+      switch (final) {
+      case 'H': case 'f': // CUP
+        y = std::min(param(0, 1), rows) - 1;
+        x = std::min(param(1, 1), cols) - 1;
+        break;
+      case 'G': case '`': x = std::min(count, cols) - 1; break; // CHA, HPA
+      case 'd': y = std::min(count, rows) - 1; break; // VPA
+      case 'A': y = std::max(y - count, y >= top ? top : 0); break; // CUU
+      case 'B': y = std::min(y + count, y <= bottom ? bottom : rows - 1); break; // CUD
+      case 'C': case 'a': x = std::min(x + count, x <= right ? right : cols - 1); break; // CUF, HPR
+      case 'D': x = std::max(x - count, x >= left ? left : 0); break; // CUB
+      case 'X': // ECH
+        for (int i = x; i < std::min(cols, x + count); i++) at(i, y) = blank();
+        break;
+      case 'K': // EL
+        {
+          int const mode = param(0, 0);
+          int const x1 = mode == 0 ? x : 0;
+          int const x2 = mode == 1 ? x + 1 : cols;
+          for (int i = x1; i < x2; i++) at(i, y) = blank();
+        }
+        break;
+      case 'J': // ED
+        {
+          int const mode = param(0, 0);
+          int const i1 = mode == 0 ? y * cols + x : 0;
+          int const i2 = mode == 1 ? y * cols + x + 1 : cols * rows;
+          for (int i = i1; i < i2; i++) cells[i] = blank();
+        }
+        break;
+      case '@': // ICH
+        shift_right(count, x, declrmm ? right : cols - 1, y, y);
+        break;
+      case 'P': // DCH
+        shift_left(count, x, declrmm ? right : cols - 1, y, y);
+        break;
+      case 'L': // IL
+        if (top <= y && y <= bottom) {
+          scroll_down(count, y, bottom);
+          x = left;
+        }
+        break;
+      case 'M': // DL
+        if (top <= y && y <= bottom) {
+          scroll_up(count, y, bottom);
+          x = left;
+        }
+        break;
+      case 'S': scroll_up(count, top, bottom); break; // SU
+      case 'T': scroll_down(count, top, bottom); break; // SD
+      case 'b': // REP
+        for (int i = 0; i < count; i++) put_char(last_char);
+        break;
+      case 'r': // DECSTBM
+        top = param(0, 1) - 1;
+        bottom = std::min(param(1, rows), rows) - 1;
+        if (top >= bottom) top = 0, bottom = rows - 1;
+        x = y = 0;
+        break;
+      case 's': // DECSLRM
+        if (declrmm) {
+          left = param(0, 1) - 1;
+          right = std::min(param(1, cols), cols) - 1;
+          if (left >= right) left = 0, right = cols - 1;
+          x = y = 0;
+        }
+        break;
+      default:
+        fail(std::string("CSI ") + final);
+        break;
+      }
+    }
+
+  private:
+    enum state_t {
+      state_ground,
+      state_escape,
+      state_escape_intermediate,
+      state_csi,
+      state_string,        // DCS, OSC, APC, PM, SOS
+      state_string_escape, // 文字列の中の ESC
+    };
+    state_t state = state_ground;
+    std::uint32_t utf8_code = 0;
+    int utf8_remain = 0;
+    bool string_bel = false; // OSC は BEL でも終わる
+    byte string_type = 0;    // 文字列の種類 (ESC P なら 'P')
+    std::string string_data; // DCS・OSC・APC の内容
+    std::string scs;         // SCS (ESC ( I... F) の中間文字と終端文字
+
+    void process_dcs() {
+      std::size_t const final = string_data.find_first_not_of("0123456789;");
+      if (final == std::string::npos) return;
+      if (string_data[final] == '{') process_decdld(final);
+      if (string_data[final] == 'q') process_sixel(final);
+    }
+
+    // DECDLD (DCS Pfn;Pcn;Pe;Pcmw;Pss;Pt;Pcmh;Pcss { Dscs Sxbp1;Sxbp2;... ST)
+    void process_decdld(std::size_t brace) {
+      std::vector<int> dld_params;
+      for (std::size_t i = 0; i <= brace; ) {
+        std::size_t const end = std::min(string_data.find(';', i), brace);
+        dld_params.push_back(std::atoi(string_data.substr(i, end - i).c_str()));
+        i = end + 1;
+      }
+      dld_params.resize(8, 0);
+
+      // Dscs: 0-2 個の中間文字と終端文字
+      std::size_t pos = brace + 1;
+      std::size_t const dscs_begin = pos;
+      while (pos < string_data.size() && 0x20 <= (byte) string_data[pos] && (byte) string_data[pos] <= 0x2F) pos++;
+      if (pos >= string_data.size()) {
+        fail("DECDLD Dscs");
+        return;
+      }
+      soft_dscs = string_data.substr(dscs_begin, ++pos - dscs_begin);
+      if (dld_params[2] != 1)
+        for (auto& glyph: soft_glyphs) glyph.clear();
+
+      // 各文字のシクセル (';' で文字、'/' で6行毎の帯を区切る)
+      int code = 0x20 + dld_params[1];
+      std::vector<std::uint16_t> rows;
+      int band = 0, column = 0;
+      for (;; pos++) {
+        byte const b = pos < string_data.size() ? string_data[pos] : ';';
+        if (b == ';') {
+          if (code < 0x80) soft_glyphs[code - 0x20] = rows;
+          if (pos >= string_data.size()) break;
+          code++;
+          rows.clear();
+          band = column = 0;
+        } else if (b == '/') {
+          band++;
+          column = 0;
+        } else if (0x3F <= b && b <= 0x7E) {
+          rows.resize(std::max<std::size_t>(rows.size(), band * 6 + 6), 0);
+          for (int k = 0; k < 6; k++)
+            if ((b - 0x3F) & 1 << k) rows[band * 6 + k] |= 1 << column;
+          column++;
+        } else {
+          fail("DECDLD sixel");
+          return;
+        }
+      }
+    }
+    // 数字の並びを読む (なければ default_value)
+    int read_number(std::size_t& pos, int default_value) const {
+      if (pos >= string_data.size() || !('0' <= string_data[pos] && string_data[pos] <= '9')) return default_value;
+      int value = 0;
+      for (; pos < string_data.size() && '0' <= string_data[pos] && string_data[pos] <= '9'; pos++)
+        value = std::min(value * 10 + (string_data[pos] - '0'), 99999);
+      return value;
+    }
+
+    // Sixel (DCS P1;P2;P3 q "Pan;Pad;Ph;Pv #Pc;Pu;Px;Py;Pz ... ST)。カーソル位置のセルの
+    // 左上から描く。P2 = 1 (0 のビットの画素は変えない) だけに対応する。
+    void process_sixel(std::size_t final) {
+      std::vector<int> dcs_params;
+      for (std::size_t i = 0; i <= final; ) {
+        std::size_t const end = std::min(string_data.find(';', i), final);
+        dcs_params.push_back(std::atoi(string_data.substr(i, end - i).c_str()));
+        i = end + 1;
+      }
+      if (dcs_params.size() < 2 || dcs_params[1] != 1) {
+        fail("sixel P2");
+        return;
+      }
+
+      int const plane_width = cols * cell_width, plane_height = rows * cell_height;
+      int const x0 = x * cell_width, y0 = y * cell_height;
+      int band = 0, column = 0;
+      std::uint32_t color = no_pixel;
+      int image_height = 0;
+      for (std::size_t pos = final + 1; pos < string_data.size(); ) {
+        byte b = string_data[pos++];
+        if (b == '"') {
+          for (int i = 0; i < 4; i++) {
+            read_number(pos, 0);
+            if (pos < string_data.size() && string_data[pos] == ';') pos++;
+          }
+          continue;
+        } else if (b == '#') {
+          int const index = read_number(pos, 0);
+          if (pos < string_data.size() && string_data[pos] == ';') {
+            int values[4] = {};
+            for (int& value: values) {
+              pos++;
+              value = read_number(pos, 0);
+              if (pos >= string_data.size() || string_data[pos] != ';') break;
+            }
+            if (values[0] != 2) {
+              fail("sixel color space " + std::to_string(values[0]));
+              return;
+            }
+            sixel_registers[index] = sixel_color(values[1], values[2], values[3]);
+          }
+          auto const it = sixel_registers.find(index);
+          if (it == sixel_registers.end()) {
+            fail("sixel color " + std::to_string(index));
+            return;
+          }
+          color = it->second;
+          continue;
+        } else if (b == '$') {
+          column = 0;
+          continue;
+        } else if (b == '-') {
+          band++;
+          column = 0;
+          continue;
+        }
+
+        int repeat = 1;
+        if (b == '!') {
+          repeat = read_number(pos, 1);
+          if (pos >= string_data.size()) break;
+          b = string_data[pos++];
+        }
+        if (!(0x3F <= b && b <= 0x7E)) {
+          fail("sixel byte " + std::to_string(b));
+          return;
+        }
+        for (int i = 0; i < repeat; i++)
+          sixel_put(b - 0x3F, x0 + column++, y0 + band * 6, color, plane_width, plane_height);
+        image_height = std::max(image_height, band * 6 + 6);
+      }
+
+      // 画像の下の行の左端に移動する (xterm の sixel scrolling と同様だが画面はスクロールしない)
+      wrap_pending = false;
+      y = std::min((y0 + image_height - 1) / cell_height + 1, rows - 1);
+    }
+    void sixel_put(int bits, int px, int py, std::uint32_t color, int plane_width, int plane_height) {
+      if (bits && color == no_pixel) {
+        fail("sixel without color");
+        return;
+      }
+      for (int k = 0; k < 6; k++)
+        if (bits & 1 << k && px < plane_width && py + k < plane_height)
+          sixel_plane[(std::size_t) (py + k) * plane_width + px] = color;
+    }
+
+    // kitty graphics protocol (APC G key=value,... ; base64 ST)。RGB (f=24) と zlib (o=z) の
+    // 転送と表示 (a=T) と削除 (a=d) に対応する。m=1 の時は続きの APC に分割されている。
+    void process_apc() {
+      if (string_data.empty() || string_data[0] != 'G') {
+        fail("APC");
+        return;
+      }
+      std::size_t const semicolon = std::min(string_data.find(';'), string_data.size());
+      std::string const keys = string_data.substr(1, semicolon - 1);
+      if (semicolon < string_data.size()) kitty_payload.append(string_data, semicolon + 1);
+      if (kitty_keys.empty()) kitty_keys = keys;
+
+      // 最後の部分 (m=0) が来たら最初の部分の制御データに従って処理する
+      std::unordered_map<std::string, std::string> values;
+      auto const parse_keys = [&values] (std::string const& keys) {
+        values.clear();
+        for (std::size_t i = 0; i < keys.size(); ) {
+          std::size_t const end = std::min(keys.find(',', i), keys.size());
+          std::size_t const eq = keys.find('=', i);
+          if (eq < end) values[keys.substr(i, eq - i)] = keys.substr(eq + 1, end - eq - 1);
+          i = end + 1;
+        }
+      };
+      auto const get = [&values] (const char* key, const char* default_value) -> std::string {
+        auto const it = values.find(key);
+        return it != values.end() ? it->second : default_value;
+      };
+      parse_keys(keys);
+      if (get("m", "0") == "1") return;
+      parse_keys(kitty_keys);
+      kitty_keys.clear();
+      std::string payload;
+      payload.swap(kitty_payload);
+
+      std::string const action = get("a", "t");
+      if (action == "d") {
+        if (get("d", "a") != "A" && get("d", "a") != "a") {
+          fail("kitty d=" + get("d", "a"));
+          return;
+        }
+        kitty_images.clear();
+        std::fill(kitty_plane.begin(), kitty_plane.end(), no_pixel);
+        return;
+      }
+      if (action != "T") {
+        fail("kitty a=" + action);
+        return;
+      }
+      if (get("f", "32") != "24") {
+        fail("kitty f=" + get("f", "32"));
+        return;
+      }
+
+      kitty_image_t image;
+      image.id = std::atoi(get("i", "0").c_str());
+      image.x = x * cell_width;
+      image.y = y * cell_height;
+      image.width = std::atoi(get("s", "0").c_str());
+      image.height = std::atoi(get("v", "0").c_str());
+      int const ncol = std::atoi(get("c", "0").c_str()), nrow = std::atoi(get("r", "0").c_str());
+      if ((ncol && ncol * cell_width != image.width) || (nrow && nrow * cell_height != image.height)) {
+        fail("kitty scaling");
+        return;
+      }
+
+      std::string data;
+      if (!decode_base64(payload, data)) {
+        fail("kitty base64");
+        return;
+      }
+      if (get("o", "") == "z") {
+        std::string raw;
+        if (!zlib_inflate(data, raw)) {
+          fail("kitty zlib");
+          return;
+        }
+        data.swap(raw);
+      }
+      if (data.size() != (std::size_t) image.width * image.height * 3) {
+        fail("kitty data size");
+        return;
+      }
+      image.data.resize((std::size_t) image.width * image.height);
+      for (std::size_t i = 0; i < image.data.size(); i++)
+        image.data[i] = (byte) data[3 * i + 2] << 16 | (byte) data[3 * i + 1] << 8 | (byte) data[3 * i];
+      if (get("C", "0") != "1") fail("kitty cursor movement");
+
+      // 同じ番号の画像は置き換える
+      for (std::size_t i = 0; i < kitty_images.size(); i++) {
+        if (kitty_images[i].id != image.id) continue;
+        kitty_image_t const old = std::move(kitty_images[i]);
+        kitty_images.erase(kitty_images.begin() + i);
+        kitty_compose(old.x, old.y, old.width, old.height);
+        break;
+      }
+      kitty_images.push_back(std::move(image));
+      kitty_image_t const& placed = kitty_images.back();
+      kitty_compose(placed.x, placed.y, placed.width, placed.height);
+    }
+    // 範囲 [x1, x1 + width) x [y1, y1 + height) の kitty_plane を画像から作り直す
+    void kitty_compose(int x1, int y1, int width, int height) {
+      int const plane_width = cols * cell_width, plane_height = rows * cell_height;
+      int const x2 = std::min(x1 + width, plane_width), y2 = std::min(y1 + height, plane_height);
+      for (int yy = y1; yy < y2; yy++)
+        std::fill(&kitty_plane[(std::size_t) yy * plane_width + x1], &kitty_plane[(std::size_t) yy * plane_width + x2], no_pixel);
+      for (kitty_image_t const& image: kitty_images) {
+        int const ix1 = std::max(x1, image.x), ix2 = std::min(x2, image.x + image.width);
+        int const iy1 = std::max(y1, image.y), iy2 = std::min(y2, image.y + image.height);
+        for (int yy = iy1; yy < iy2; yy++)
+          for (int xx = ix1; xx < ix2; xx++)
+            kitty_plane[(std::size_t) yy * plane_width + xx] = image.data[(std::size_t) (yy - image.y) * image.width + xx - image.x];
+      }
+    }
+
+    static bool decode_base64(std::string const& src, std::string& dst) {
+      dst.clear();
+      std::uint32_t buffer = 0;
+      int bits = 0;
+      for (char const ch: src) {
+        int value;
+        if ('A' <= ch && ch <= 'Z') value = ch - 'A';
+        else if ('a' <= ch && ch <= 'z') value = ch - 'a' + 26;
+        else if ('0' <= ch && ch <= '9') value = ch - '0' + 52;
+        else if (ch == '+') value = 62;
+        else if (ch == '/') value = 63;
+        else if (ch == '=') break;
+        else return false;
+        buffer = buffer << 6 | value;
+        bits += 6;
+        if (bits >= 8) {
+          bits -= 8;
+          dst += (char) (0xFF & buffer >> bits);
+        }
+      }
+      return true;
+    }
+
+    // zlib (RFC 1950/1951) の展開。格納・固定 Huffman・動的 Huffman の全てのブロックに対応する。
+    class inflater_t {
+      std::string const& src;
+      std::string& dst;
+      std::size_t pos = 2;
+      std::uint32_t bit_buffer = 0;
+      int bit_count = 0;
+      bool overrun = false;
+
+      struct huffman_t {
+        std::uint16_t count[16];
+        std::uint16_t symbol[320];
+      };
+
+      int get_bits(int count) {
+        while (bit_count < count) {
+          if (pos >= src.size()) {
+            overrun = true;
+            return 0;
+          }
+          bit_buffer |= (std::uint32_t) (byte) src[pos++] << bit_count;
+          bit_count += 8;
+        }
+        int const value = bit_buffer & ((1u << count) - 1);
+        bit_buffer >>= count;
+        bit_count -= count;
+        return value;
+      }
+      static bool build(huffman_t& h, byte const* lengths, int n) {
+        std::fill_n(h.count, 16, 0);
+        for (int i = 0; i < n; i++) h.count[lengths[i]]++;
+        int left = 1;
+        for (int len = 1; len < 16; len++) {
+          left = 2 * left - h.count[len];
+          if (left < 0) return false;
+        }
+        std::uint16_t offsets[16];
+        offsets[1] = 0;
+        for (int len = 1; len < 15; len++) offsets[len + 1] = offsets[len] + h.count[len];
+        for (int i = 0; i < n; i++)
+          if (lengths[i]) h.symbol[offsets[lengths[i]]++] = i;
+        return true;
+      }
+      // 正準 Huffman 符号を1ビットずつ読む
+      int decode(huffman_t const& h) {
+        int code = 0, first = 0, index = 0;
+        for (int len = 1; len < 16; len++) {
+          code |= get_bits(1);
+          if (overrun) return -1;
+          int const count = h.count[len];
+          if (code - count < first) return h.symbol[index + (code - first)];
+          index += count;
+          first = (first + count) << 1;
+          code <<= 1;
+        }
+        return -1;
+      }
+      bool codes(huffman_t const& lencode, huffman_t const& distcode) {
+        static constexpr std::uint16_t length_base[] = {
+          3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+          35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static constexpr byte length_extra[] = {
+          0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+          3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        static constexpr std::uint16_t dist_base[] = {
+          1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+          257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+        static constexpr byte dist_extra[] = {
+          0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+          7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+        for (;;) {
+          int symbol = decode(lencode);
+          if (symbol < 0) return false;
+          if (symbol < 256) {
+            dst += (char) symbol;
+          } else if (symbol == 256) {
+            return true;
+          } else {
+            symbol -= 257;
+            if (symbol >= 29) return false;
+            std::size_t const length = length_base[symbol] + get_bits(length_extra[symbol]);
+            int const dsymbol = decode(distcode);
+            if (dsymbol < 0 || dsymbol >= 30) return false;
+            std::size_t const distance = dist_base[dsymbol] + get_bits(dist_extra[dsymbol]);
+            if (overrun || distance > dst.size()) return false;
+            for (std::size_t i = 0; i < length; i++) dst += dst[dst.size() - distance];
+          }
+        }
+      }
+      bool stored() {
+        bit_buffer = 0;
+        bit_count = 0;
+        if (pos + 4 > src.size()) return false;
+        std::size_t const length = (byte) src[pos] | (byte) src[pos + 1] << 8;
+        if ((length ^ ((byte) src[pos + 2] | (byte) src[pos + 3] << 8)) != 0xFFFF) return false;
+        pos += 4;
+        if (pos + length > src.size()) return false;
+        dst.append(src, pos, length);
+        pos += length;
+        return true;
+      }
+      bool fixed() {
+        byte lengths[288 + 30];
+        std::fill_n(lengths, 144, 8);
+        std::fill_n(lengths + 144, 112, 9);
+        std::fill_n(lengths + 256, 24, 7);
+        std::fill_n(lengths + 280, 8, 8);
+        std::fill_n(lengths + 288, 30, 5);
+        huffman_t lencode, distcode;
+        build(lencode, lengths, 288);
+        build(distcode, lengths + 288, 30);
+        return codes(lencode, distcode);
+      }
+      bool dynamic() {
+        static constexpr byte order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        int const nlen = get_bits(5) + 257, ndist = get_bits(5) + 1, ncode = get_bits(4) + 4;
+        if (overrun || nlen > 286 || ndist > 30) return false;
+        byte lengths[320] = {};
+        for (int i = 0; i < ncode; i++) lengths[order[i]] = get_bits(3);
+        huffman_t lencode, distcode;
+        if (!build(lencode, lengths, 19)) return false;
+        for (int i = 0; i < nlen + ndist; ) {
+          int const symbol = decode(lencode);
+          if (symbol < 0) return false;
+          if (symbol < 16) {
+            lengths[i++] = symbol;
+            continue;
+          }
+          int value = 0, repeat;
+          if (symbol == 16) {
+            if (i == 0) return false;
+            value = lengths[i - 1];
+            repeat = 3 + get_bits(2);
+          } else if (symbol == 17) {
+            repeat = 3 + get_bits(3);
+          } else {
+            repeat = 11 + get_bits(7);
+          }
+          if (i + repeat > nlen + ndist) return false;
+          while (repeat--) lengths[i++] = value;
+        }
+        return build(lencode, lengths, nlen) && build(distcode, lengths + nlen, ndist) && codes(lencode, distcode);
+      }
+
+    public:
+      inflater_t(std::string const& src, std::string& dst): src(src), dst(dst) {}
+      bool run() {
+        if (src.size() < 6 || ((byte) src[0] & 0x0F) != 8 || ((byte) src[0] << 8 | (byte) src[1]) % 31) return false;
+        for (bool last = false; !last; ) {
+          last = get_bits(1);
+          int const type = get_bits(2);
+          bool const ok = type == 0 ? stored() : type == 1 ? fixed() : type == 2 ? dynamic() : false;
+          if (!ok || overrun) return false;
+        }
+
+        // Adler-32
+        std::uint32_t a = 1, b = 0;
+        for (char const ch: dst) {
+          a = (a + (byte) ch) % 65521;
+          b = (b + a) % 65521;
+        }
+        std::uint32_t adler = 0;
+        for (int i = 0; i < 4; i++) adler = adler << 8 | (byte) src[src.size() - 4 + i];
+        return adler == (b << 16 | a);
+      }
+    };
+    static bool zlib_inflate(std::string const& src, std::string& dst) {
+      dst.clear();
+      return inflater_t(src, dst).run();
+    }
+
+    // OSC 4 ; c ; spec ; ... (色番号の設定) と OSC 104 ; c ; ... (既定に戻す)
+    void process_osc() {
+      std::vector<std::string> fields;
+      for (std::size_t i = 0; i <= string_data.size(); ) {
+        std::size_t const end = std::min(string_data.find(';', i), string_data.size());
+        fields.push_back(string_data.substr(i, end - i));
+        i = end + 1;
+      }
+      if (fields[0] == "4") {
+        for (std::size_t i = 1; i + 1 < fields.size(); i += 2) {
+          unsigned r, g, b;
+          if (std::sscanf(fields[i + 1].c_str(), "rgb:%2x/%2x/%2x", &r, &g, &b) != 3) {
+            fail("OSC 4 " + fields[i + 1]);
+            continue;
+          }
+          palette["5:" + fields[i]] = "2:" + std::to_string(r) + ":" + std::to_string(g) + ":" + std::to_string(b);
+        }
+      } else if (fields[0] == "104") {
+        if (fields.size() == 1) palette.clear();
+        for (std::size_t i = 1; i < fields.size(); i++)
+          palette.erase("5:" + fields[i]);
+      }
+    }
+    void end_string() {
+      state = state_ground;
+      if (string_type == 'P') process_dcs();
+      if (string_type == ']') process_osc();
+      if (string_type == '_') process_apc();
+    }
+    void designate(int index, std::string const& charset) {
+      if (charset != "B" && charset != soft_dscs) fail("SCS " + charset);
+      if (index < 2) charsets[index] = charset;
+    }
+
+    void start_csi() {
+      state = state_csi;
+      subparams.assign(1, std::string());
+      intermediate.clear();
+      private_marker = 0;
+    }
+    void process_csi(byte b) {
+      if (('0' <= b && b <= '9') || b == ':') {
+        subparams.back() += b;
+      } else if (b == ';') {
+        subparams.emplace_back();
+      } else if ('<' <= b && b <= '?') {
+        private_marker = b;
+      } else if (0x20 <= b && b <= 0x2F) {
+        intermediate += b;
+      } else if (0x40 <= b && b <= 0x7E) {
+        state = state_ground;
+        // 空の引数は 0 と同じに扱う
+        params.clear();
+        for (std::string const& subparam: subparams)
+          params.push_back(std::min(std::atoi(subparam.c_str()), 99999));
+        dispatch_csi(b);
+      } else {
+        fail("CSI byte " + std::to_string(b));
+        state = state_ground;
+      }
+    }
+
+    void process_escape(byte b) {
+      state = state_ground;
+      switch (b) {
+      case '[': start_csi(); break;
+      case 'P': case ']': case '_': case '^': case 'X':
+        state = state_string;
+        string_bel = b == ']';
+        string_type = b;
+        string_data.clear();
+        break;
+      case '\\': break; // ST
+      case '(': case ')': case '*': case '+':
+        state = state_escape_intermediate;
+        scs.assign(1, b);
+        break;
+      default:
+        fail(std::string("ESC ") + (char) b);
+        break;
+      }
+    }
+
+    void process_ground(byte b) {
+      if (utf8_remain) {
+        if ((b & 0xC0) == 0x80) {
+          utf8_code = utf8_code << 6 | (b & 0x3F);
+          if (--utf8_remain == 0) put_char(utf8_code);
+          return;
+        }
+        fail("UTF-8");
+        utf8_remain = 0;
+      }
+
+      if (b < 0x20) {
+        switch (b) {
+        case 0x1B: state = state_escape; break;
+        case '\r': x = x >= left ? left : 0; wrap_pending = false; break;
+        case '\n': case '\v': case '\f': line_feed(); break;
+        case '\b': if (x > 0) x--; wrap_pending = false; break;
+        case 0x18: break; // CAN
+        case 0x0E: gl = 1; break; // SO
+        case 0x0F: gl = 0; break; // SI
+        default: fail("C0 " + std::to_string(b)); break;
+        }
+      } else if (b < 0x80) {
+        if (0x21 <= b && b <= 0x7E && !soft_dscs.empty() && charsets[gl] == soft_dscs)
+          put_char(soft_char_base + b);
+        else
+          put_char(b);
+      } else if (b >= 0xF0) {
+        utf8_code = b & 0x07;
+        utf8_remain = 3;
+      } else if (b >= 0xE0) {
+        utf8_code = b & 0x0F;
+        utf8_remain = 2;
+      } else if (b >= 0xC0) {
+        utf8_code = b & 0x1F;
+        utf8_remain = 1;
+      } else {
+        fail("UTF-8");
+      }
+    }
+
+  public:
+    void feed(const char* data, std::size_t size) {
+      for (std::size_t i = 0; i < size; i++) {
+        byte const b = data[i];
+        if (b == 0x18 && state != state_ground) {
+          // CAN は制御機能を中断する
+          state = state_ground;
+          continue;
+        }
+        switch (state) {
+        case state_ground: process_ground(b); break;
+        case state_escape: process_escape(b); break;
+        case state_escape_intermediate:
+          scs += b;
+          if (b < 0x20 || 0x30 <= b) {
+            state = state_ground;
+            designate(scs[0] - '(', scs.substr(1));
+          }
+          break;
+        case state_csi: process_csi(b); break;
+        case state_string:
+          if (b == 0x1B)
+            state = state_string_escape;
+          else if (b == 0x07 && string_bel)
+            end_string();
+          else if ((string_type == 'P' || string_type == ']' || string_type == '_') && string_data.size() < 0x100000)
+            string_data += b;
+          break;
+        case state_string_escape:
+          if (b == '\\')
+            end_string();
+          else
+            state = state_string;
+          break;
+        }
+      }
+    }
+  };
+}
+
+#endif